@@ -0,0 +1,643 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <cstdio>      // for snprintf, perror
+#include <cstdlib>     // for posix_openpt, grantpt, unlockpt, ptsname, mkdtemp
+#include <cerrno>      // for errno
+#include <cstring>     // for memcmp
+#include <cmath>       // for cos, sin
+#include <chrono>      // for steady_clock
+#include <algorithm>   // for std::min
+#include <unistd.h>    // for read, write, close, fork, execv
+#include <getopt.h>    // for getopt_long
+#include <fcntl.h>     // for open
+#include <termios.h>   // for termios
+#include <poll.h>      // for ppoll
+#include <sys/wait.h>  // for waitpid
+
+// Benchmark harness for grbl_streamer. Opens a pseudo-terminal pair, runs a
+// simulated GRBL on the master side and has grbl_streamer stream synthetic
+// G-code files to the slave side. The simulator models the RX buffer, the
+// planner buffer and its consume rate, and the baud rate of the link, and it
+// switches check mode ($C) as GRBL does for --check runs. With --replay it
+// streams the lines of a recorded session instead and answers each no
+// earlier than the real controller did.
+
+using Clock = std::chrono::steady_clock;
+using Nanos = int64_t;
+
+Nanos nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// A line of a recorded session and the real controller's answer to it
+struct ReplayLine {
+    std::string text;    // As sent, without the line end
+    std::string answer;  // "ok" or "error:N"
+    Nanos answered;      // Time of the answer since the first replayed line was sent
+};
+
+// Settings of the simulated controller
+struct SimOptions {
+    int rx_buffer = 128;          // RX buffer size as GRBL defines it (usable space is one less)
+    int planner_blocks = 15;      // Planner buffer blocks
+    int baud = 115200;            // Link speed, 0 for unthrottled
+    Nanos block_time = 2000000;   // Time the planner spends executing one motion block
+    int error_every = 0;          // Answer every Nth line with error:20, 0 for never
+    const std::vector<ReplayLine>* replay = nullptr;  // Recorded answers to replay, in order
+    double replay_speed = 1;      // Replay the recorded timing this many times faster
+};
+
+// Simulated GRBL controller. Bytes from the host reach the RX buffer at the
+// link's baud rate, complete lines move into the planner (motion lines take a
+// block, and wait for one to be free) and are acknowledged with "ok", and the
+// planner retires one block every block_time. Real-time bytes ('?', '!', '~',
+// 0x18 and overrides) are picked out of the stream on arrival, as GRBL does.
+class SimulatedGrbl {
+public:
+    explicit SimulatedGrbl(const SimOptions& options)
+        : options_(options),
+          byte_time_(options.baud > 0 ? 10000000000LL / options.baud : 0) {}
+
+    // Bytes written by the host at time now; they arrive one byte time apart
+    void receive(const char* data, size_t len, Nanos now) {
+        Nanos t = std::max(now, last_arrival_);
+        for (size_t i = 0; i < len; ++i) {
+            t += byte_time_;
+            incoming_.push_back({data[i], t});
+        }
+        last_arrival_ = t;
+    }
+
+    // Advance the model to time now
+    void advance(Nanos now) {
+        while (true) {
+            Nanos next = nextInternalEvent();
+            if (next > now) break;
+            step(next);
+        }
+        step(now);
+    }
+
+    // Earliest time something changes without new input (INT64_MAX if never)
+    Nanos nextEventTime() const {
+        Nanos next = nextInternalEvent();
+        if (!outgoing_.empty()) next = std::min(next, outgoing_due_);
+        return next;
+    }
+
+    // Response bytes whose transmission time has come, appended to out
+    void takeOutput(Nanos now, std::string& out) {
+        while (!outgoing_.empty() && outgoing_due_ <= now) {
+            out += outgoing_.front();
+            outgoing_.pop_front();
+            outgoing_due_ += byte_time_;
+        }
+    }
+
+    // Queue a startup banner as GRBL prints after reset
+    void banner(Nanos now) { respond("\r\nGrbl 1.1h ['$' for help]\r\n", now); }
+
+    // Time the planner sat empty between two motion blocks
+    Nanos stallTime() const { return stall_time_; }
+    uint64_t replayMismatches() const { return replay_mismatches_; }
+    uint64_t overflows() const { return overflows_; }
+    uint64_t linesProcessed() const { return lines_; }
+
+private:
+    struct Byte {
+        char c;
+        Nanos at;
+    };
+
+    Nanos nextInternalEvent() const {
+        Nanos next = INT64_MAX;
+        if (!incoming_.empty()) next = incoming_.front().at;
+        if (planner_used_ > 0) next = std::min(next, block_end_);
+        return std::min(next, replay_due_);
+    }
+
+    void step(Nanos now) {
+        while (!incoming_.empty() && incoming_.front().at <= now) {
+            char c = incoming_.front().c;
+            incoming_.pop_front();
+            if (!realtime(c, now)) {
+                if (static_cast<int>(rx_.size()) >= options_.rx_buffer - 1) {
+                    ++overflows_;  // The real controller would corrupt the stream here
+                } else {
+                    rx_.push_back(c);
+                }
+            }
+        }
+        while (planner_used_ > 0 && block_end_ <= now) {
+            Nanos finished = block_end_;
+            if (--planner_used_ > 0) {
+                block_end_ = finished + options_.block_time;
+            } else {
+                empty_since_ = finished;
+            }
+        }
+        parseLines(now);
+    }
+
+    // Handle a real-time byte. Returns false for ordinary stream bytes.
+    bool realtime(char c, Nanos now) {
+        unsigned char u = static_cast<unsigned char>(c);
+        if (c == '?') {
+            bool idle = planner_used_ == 0 && rx_.empty();
+            char report[128];
+            snprintf(report, sizeof(report), "<%s|MPos:0.000,0.000,0.000|Bf:%d,%d|FS:0,0>\r\n",
+                     idle ? "Idle" : "Run", options_.planner_blocks - planner_used_,
+                     options_.rx_buffer - static_cast<int>(rx_.size()));
+            respond(report, now);
+            return true;
+        }
+        return c == '!' || c == '~' || u == 0x18 || u >= 0x80;
+    }
+
+    // Move complete lines from the RX buffer into the planner
+    void parseLines(Nanos now) {
+        while (true) {
+            size_t end = 0;
+            while (end < rx_.size() && rx_[end] != '\n' && rx_[end] != '\r') ++end;
+            if (end == rx_.size()) return;
+            std::string line(rx_.begin(), rx_.begin() + end);
+            if (replaying(line)) {
+                // Answer as the real controller did, but not before its time
+                const ReplayLine& recorded = (*options_.replay)[replay_pos_];
+                if (replay_origin_ < 0) replay_origin_ = now;
+                Nanos due = replay_origin_ + static_cast<Nanos>(recorded.answered / options_.replay_speed);
+                if (now < due) {
+                    replay_due_ = due;
+                    return;
+                }
+                replay_due_ = INT64_MAX;
+                rx_.erase(rx_.begin(), rx_.begin() + end + 1);
+                if (line != recorded.text) ++replay_mismatches_;
+                ++replay_pos_;
+                ++lines_;
+                respond((recorded.answer + "\r\n").c_str(), now);
+                continue;
+            }
+            if (line == "$C" && planner_used_ == 0) {
+                // Check mode: on, or off with the soft reset GRBL does on leaving it
+                rx_.erase(rx_.begin(), rx_.begin() + end + 1);
+                ++lines_;
+                check_mode_ = !check_mode_;
+                respond(check_mode_ ? "[MSG:Enabled]\r\nok\r\n" : "[MSG:Disabled]\r\nok\r\n", now);
+                if (!check_mode_) banner(now);
+                continue;
+            }
+            bool motion = !check_mode_ && isMotion(line);  // Checked lines never reach the planner
+            if (motion && planner_used_ == options_.planner_blocks) return;  // Wait for a free block
+            rx_.erase(rx_.begin(), rx_.begin() + end + 1);
+
+            if (line.empty()) {
+                respond("ok\r\n", now);  // GRBL acknowledges empty lines for syncing
+                continue;
+            }
+            ++lines_;
+            if (line == "$C") {
+                respond("error:8\r\n", now);  // Only switched while idle
+                continue;
+            }
+            if (line == "$I") {
+                char info[96];
+                snprintf(info, sizeof(info), "[VER:1.1h.20190825:]\r\n[OPT:V,%d,%d]\r\n",
+                         options_.planner_blocks, options_.rx_buffer);
+                respond(info, now);
+            }
+            if (options_.error_every > 0 && lines_ % options_.error_every == 0) {
+                respond("error:20\r\n", now);
+                continue;
+            }
+            if (motion) {
+                if (planner_used_++ == 0) {
+                    block_end_ = now + options_.block_time;
+                    if (empty_since_ >= 0) stall_time_ += now - empty_since_;
+                }
+            }
+            respond("ok\r\n", now);
+        }
+    }
+
+    // True if line takes the next recorded answer. Empty lines and $
+    // commands belong to the streamer's handshake and are answered live.
+    bool replaying(const std::string& line) const {
+        return options_.replay != nullptr && replay_pos_ < options_.replay->size() && !line.empty() && line[0] != '$';
+    }
+
+    static bool isMotion(const std::string& line) {
+        for (char c : line) {
+            if (c == 'X' || c == 'Y' || c == 'Z' || c == 'x' || c == 'y' || c == 'z') return true;
+        }
+        return false;
+    }
+
+    void respond(const char* text, Nanos now) {
+        if (outgoing_.empty()) outgoing_due_ = now + byte_time_;
+        for (const char* p = text; *p != '\0'; ++p) outgoing_.push_back(*p);
+    }
+
+    SimOptions options_;
+    Nanos byte_time_;
+    std::deque<Byte> incoming_;   // Bytes on the wire towards the controller
+    Nanos last_arrival_ = 0;
+    std::deque<char> rx_;         // Controller RX buffer
+    std::deque<char> outgoing_;   // Bytes on the wire towards the host
+    Nanos outgoing_due_ = 0;      // Time the first outgoing byte has been sent
+    int planner_used_ = 0;
+    Nanos block_end_ = 0;         // Completion time of the executing block
+    Nanos empty_since_ = -1;      // Planner emptied at this time (-1 before the first block)
+    Nanos stall_time_ = 0;
+    uint64_t overflows_ = 0;
+    uint64_t lines_ = 0;
+    bool check_mode_ = false;     // $C: lines are parsed and answered, nothing moves
+    size_t replay_pos_ = 0;       // Next recorded answer
+    Nanos replay_origin_ = -1;    // Arrival of the first replayed line
+    Nanos replay_due_ = INT64_MAX;  // Time the waiting line may be answered
+    uint64_t replay_mismatches_ = 0;
+};
+
+// Serial trace written by grbl_streamer --trace: this header, then a chunk
+// header and its bytes for every read() and write() on the port
+struct TraceFileHeader {
+    char magic[8];      // "GSTRACE1"
+    uint64_t start_ns;
+    uint32_t baud;
+    uint32_t reserved;
+};
+
+struct TraceChunk {
+    uint64_t time_ns;
+    uint32_t len;
+    uint8_t direction;  // 0 sent to the controller, 1 received from it
+    uint8_t port;
+    uint16_t reserved;
+};
+
+// Function to rebuild the lines of a recorded session and their answers.
+// Each ok or error: answers the oldest unanswered line, as GRBL's
+// responses come in order; a reset or alarm drops the unanswered ones.
+// Only the first port of the trace is used. Returns false if path is not a
+// trace.
+bool loadTrace(const std::string& path, std::vector<ReplayLine>& lines) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) return false;
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "GSTRACE1", 8) != 0) {
+        fclose(f);
+        return false;
+    }
+    struct Sent {
+        std::string text;
+        Nanos at;
+    };
+    std::vector<Sent> sent;
+    size_t unanswered = 0;
+    std::string partial_sent;
+    std::string partial_received;
+    int port = -1;
+    Nanos first_sent = -1;
+    std::vector<char> data;
+    TraceChunk chunk;
+    while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+        data.resize(chunk.len);
+        if (chunk.len > 0 && fread(data.data(), chunk.len, 1, f) != 1) break;
+        if (port == -1) port = chunk.port;
+        if (chunk.port != port) continue;
+        Nanos at = static_cast<Nanos>(chunk.time_ns);
+        for (char c : data) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (chunk.direction == 0) {
+                if (c == '?' || c == '!' || c == '~' || u == 0x18 || u >= 0x80) continue;  // Real-time
+                if (c != '\n' && c != '\r') {
+                    partial_sent += c;
+                    continue;
+                }
+                sent.push_back({partial_sent, at});
+                partial_sent.clear();
+            } else if (c != '\n') {
+                partial_received += c;
+            } else {
+                std::string response = partial_received;
+                partial_received.clear();
+                if (!response.empty() && response.back() == '\r') response.pop_back();
+                bool answer = response == "ok" || response.compare(0, 6, "error:") == 0;
+                if (answer && unanswered < sent.size()) {
+                    Sent& line = sent[unanswered++];
+                    if (!line.text.empty() && line.text[0] != '$') {
+                        if (first_sent < 0) first_sent = line.at;
+                        lines.push_back({line.text, response, at - first_sent});
+                    }
+                } else if (response.compare(0, 6, "ALARM:") == 0 || response.compare(0, 5, "Grbl ") == 0) {
+                    unanswered = sent.size();
+                }
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+// Function to write the replayed lines as the G-code file to stream
+bool writeReplay(const std::vector<ReplayLine>& lines, const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr) return false;
+    for (const ReplayLine& line : lines) fprintf(f, "%s\n", line.text.c_str());
+    return fclose(f) == 0;
+}
+
+// Function to write a synthetic G-code file for a workload. Returns false on error.
+bool writeWorkload(const std::string& name, const std::string& path, int lines) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr) return false;
+    fprintf(f, "G21 G90 G17\nG0 X0 Y0 Z1\n");
+    if (name == "short") {
+        // Dense 3D surfacing: 0.01 mm segments
+        for (int i = 0; i < lines; ++i) {
+            fprintf(f, "G1 X%.3f Y%.3f Z%.3f F1500\n", i * 0.01, (i / 1000) * 0.1, -0.5 + 0.001 * (i % 100));
+        }
+    } else if (name == "arcs") {
+        // Long arcs around a spiral
+        for (int i = 0; i < lines; ++i) {
+            double r = 10 + i * 0.01;
+            double a = (i % 2 == 0) ? 0 : 3.14159265358979;
+            fprintf(f, "G%d X%.4f Y%.4f I%.4f J0 F800\n", (i % 3 == 0) ? 3 : 2, r * std::cos(a + 3.14159265358979),
+                    r * std::sin(a + 3.14159265358979), -r * std::cos(a));
+        }
+    } else if (name == "mixed") {
+        // Comments, blank lines, CRLF endings and non-motion lines
+        for (int i = 0; i < lines; ++i) {
+            switch (i % 8) {
+                case 0: fprintf(f, "; pass %d\n", i / 8); break;
+                case 1: fprintf(f, "G1 X%.3f Y%.3f F1200 (cut)\r\n", i * 0.1, i * 0.05); break;
+                case 2: fprintf(f, "\n"); break;
+                case 3: fprintf(f, "  G0 Z%.3f  \n", 1 + (i % 5) * 0.1); break;
+                case 4: fprintf(f, "M3 S%d\n", 10000 + i % 1000); break;
+                default: fprintf(f, "G1 X%.4f Y%.4f ; move\n", i * 0.1, i * 0.07); break;
+            }
+        }
+    } else {
+        fclose(f);
+        return false;
+    }
+    fprintf(f, "M5\nG0 Z5\n");
+    return fclose(f) == 0;
+}
+
+// Function to read a numeric field from the streamer's JSON statistics file
+double jsonField(const std::string& json, const char* key) {
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t pos = json.find(pattern);
+    if (pos == std::string::npos) return -1;
+    return strtod(json.c_str() + pos + pattern.size(), nullptr);
+}
+
+std::string readFile(const std::string& path) {
+    std::string data;
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == nullptr) return data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+    fclose(f);
+    return data;
+}
+
+// Result of streaming one workload
+struct BenchResult {
+    bool ok = false;
+    int exit_code = -1;
+    double elapsed = 0;        // Streaming time reported by the streamer
+    double lines_per_s = 0;
+    double bytes_per_s = 0;
+    double latency_p50 = 0;
+    double latency_p99 = 0;
+    double window_full = 0;
+    double stall = 0;          // Planner starvation seen by the simulator
+    double writes = 0;
+    double reads = 0;
+    double polls = 0;
+    uint64_t lines = 0;
+    uint64_t overflows = 0;
+    uint64_t replay_mismatches = 0;
+};
+
+// Function to run grbl_streamer against a simulated controller on a pty
+BenchResult runBenchmark(const char* streamer, const std::string& gcode, const SimOptions& options,
+                         const std::vector<const char*>& extra_args, const std::string& stats_path) {
+    BenchResult result;
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return result;
+    }
+    std::string slave_name = ptsname(master);
+
+    // Keep a raw-mode slave open so the pty never echoes and never hangs up
+    int slave = open(slave_name.c_str(), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    std::vector<const char*> args = {streamer, "-S", slave_name.c_str(), "-f", gcode.c_str(),
+                                     "--stats-file", stats_path.c_str()};
+    args.insert(args.end(), extra_args.begin(), extra_args.end());
+    args.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(master);
+        close(slave);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(streamer, const_cast<char* const*>(args.data()));
+        perror("execv");
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        close(master);
+        close(slave);
+        return result;
+    }
+
+    SimulatedGrbl grbl(options);
+    grbl.banner(nowNanos());
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    std::string out;
+    char buf[4096];
+    int status = 0;
+    while (true) {
+        if (waitpid(pid, &status, WNOHANG) == pid) break;
+
+        Nanos now = nowNanos();
+        grbl.advance(now);
+        out.clear();
+        grbl.takeOutput(now, out);
+        if (!out.empty() && write(master, out.data(), out.size()) < 0 && errno != EAGAIN) break;
+
+        // Sleep until the next simulated event; 10 ms at most so the
+        // child's exit is noticed
+        Nanos wait = std::min<Nanos>(10000000, std::max<Nanos>(0, grbl.nextEventTime() - now));
+        struct timespec timeout = {static_cast<time_t>(wait / 1000000000), static_cast<long>(wait % 1000000000)};
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (ppoll(&pfd, 1, &timeout, nullptr) > 0 && (pfd.revents & POLLIN)) {
+            ssize_t n = read(master, buf, sizeof(buf));
+            if (n > 0) grbl.receive(buf, n, nowNanos());
+        }
+    }
+    close(master);
+    close(slave);
+
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    std::string json = readFile(stats_path);
+    result.ok = !json.empty();
+    result.elapsed = jsonField(json, "elapsed_s");
+    result.lines_per_s = jsonField(json, "lines_per_s");
+    result.bytes_per_s = jsonField(json, "bytes_per_s");
+    result.latency_p50 = jsonField(json, "latency_p50_us");
+    result.latency_p99 = jsonField(json, "latency_p99_us");
+    result.window_full = jsonField(json, "window_full_s");
+    result.writes = jsonField(json, "writes");
+    result.reads = jsonField(json, "reads");
+    result.polls = jsonField(json, "polls");
+    result.stall = grbl.stallTime() / 1e9;
+    result.lines = grbl.linesProcessed();
+    result.overflows = grbl.overflows();
+    result.replay_mismatches = grbl.replayMismatches();
+    return result;
+}
+
+// Function to print help
+void printHelp(const char* progName) {
+    std::cout << "Usage: " << progName << " [options] [-- streamer options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s, --streamer <path>      grbl_streamer binary (default: ./grbl_streamer)" << std::endl;
+    std::cout << "  -w, --workload <name>      short, arcs, mixed or all (default: all)" << std::endl;
+    std::cout << "  -n, --lines <n>            Lines per synthetic file (default: 20000)" << std::endl;
+    std::cout << "  -b, --baud <rate>          Simulated link speed, 0 for unthrottled (default: 115200)" << std::endl;
+    std::cout << "  -r, --rx-buffer <bytes>    Simulated RX buffer size (default: 128)" << std::endl;
+    std::cout << "  -p, --planner <blocks>     Simulated planner blocks (default: 15)" << std::endl;
+    std::cout << "  -t, --block-time <us>      Time to execute one motion block (default: 2000)" << std::endl;
+    std::cout << "  -e, --error-every <n>      Answer every nth line with error:20" << std::endl;
+    std::cout << "  -R, --replay <trace>       Stream the lines of a grbl_streamer --trace recording and" << std::endl;
+    std::cout << "                             answer each no earlier than the real controller did" << std::endl;
+    std::cout << "  -x, --speed <factor>       Replay the recorded timing this many times faster (default: 1)" << std::endl;
+    std::cout << "  -h, --help                 Display this help message" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example: " << progName << " -w short -b 230400 -- --compact" << std::endl;
+    std::cout << "         " << progName << " -R job.trace -x 2 -- -r auto" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    const char* streamer = "./grbl_streamer";
+    std::string workload = "all";
+    int lines = 20000;
+    SimOptions options;
+    const char* replay_path = nullptr;
+    std::vector<ReplayLine> replay;
+
+    static struct option long_options[] = {
+        {"streamer", required_argument, nullptr, 's'},
+        {"workload", required_argument, nullptr, 'w'},
+        {"lines", required_argument, nullptr, 'n'},
+        {"baud", required_argument, nullptr, 'b'},
+        {"rx-buffer", required_argument, nullptr, 'r'},
+        {"planner", required_argument, nullptr, 'p'},
+        {"block-time", required_argument, nullptr, 't'},
+        {"error-every", required_argument, nullptr, 'e'},
+        {"replay", required_argument, nullptr, 'R'},
+        {"speed", required_argument, nullptr, 'x'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:w:n:b:r:p:t:e:R:x:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 's': streamer = optarg; break;
+            case 'w': workload = optarg; break;
+            case 'n': lines = std::stoi(optarg); break;
+            case 'b': options.baud = std::stoi(optarg); break;
+            case 'r': options.rx_buffer = std::stoi(optarg); break;
+            case 'p': options.planner_blocks = std::stoi(optarg); break;
+            case 't': options.block_time = std::stoll(optarg) * 1000; break;
+            case 'e': options.error_every = std::stoi(optarg); break;
+            case 'R': replay_path = optarg; break;
+            case 'x': options.replay_speed = std::stod(optarg); break;
+            case 'h':
+                printHelp(argv[0]);
+                return 0;
+            default:
+                printHelp(argv[0]);
+                return 1;
+        }
+    }
+    std::vector<const char*> extra_args(argv + optind, argv + argc);
+
+    std::vector<std::string> workloads;
+    if (replay_path != nullptr) {
+        if (!loadTrace(replay_path, replay) || replay.empty()) {
+            std::cerr << "No replayable lines in trace: " << replay_path << std::endl;
+            return 1;
+        }
+        if (options.replay_speed <= 0) {
+            std::cerr << "Replay speed must be positive." << std::endl;
+            return 1;
+        }
+        printf("Replaying %zu lines, answered in %.3f s when recorded, at %gx\n", replay.size(),
+               replay.back().answered / 1e9, options.replay_speed);
+        options.replay = &replay;
+        workloads = {"replay"};
+    } else if (workload == "all") {
+        workloads = {"short", "arcs", "mixed"};
+    } else {
+        workloads = {workload};
+    }
+
+    char dir_template[] = "/tmp/grbl_bench.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+
+    printf("%-8s %8s %9s %10s %10s %9s %9s %8s %8s %8s %8s %8s %5s\n", "workload", "lines", "time_s",
+           "lines/s", "bytes/s", "p50_us", "p99_us", "full_s", "stall_s", "writes", "reads", "polls", "ovf");
+    int return_code = 0;
+    for (const std::string& name : workloads) {
+        std::string gcode = dir + "/" + name + ".nc";
+        std::string stats = dir + "/" + name + ".json";
+        bool written = options.replay != nullptr ? writeReplay(replay, gcode) : writeWorkload(name, gcode, lines);
+        if (!written) {
+            std::cerr << "Unknown workload: " << name << std::endl;
+            return_code = 1;
+            continue;
+        }
+        BenchResult r = runBenchmark(streamer, gcode, options, extra_args, stats);
+        if (!r.ok) {
+            std::cerr << name << ": streamer produced no statistics (exit code " << r.exit_code << ")" << std::endl;
+            return_code = 1;
+        } else {
+            printf("%-8s %8llu %9.3f %10.0f %10.0f %9.0f %9.0f %8.3f %8.3f %8.0f %8.0f %8.0f %5llu\n", name.c_str(),
+                   static_cast<unsigned long long>(r.lines), r.elapsed, r.lines_per_s, r.bytes_per_s,
+                   r.latency_p50, r.latency_p99, r.window_full, r.stall, r.writes, r.reads, r.polls,
+                   static_cast<unsigned long long>(r.overflows));
+            if (r.overflows > 0) return_code = 1;
+            if (r.replay_mismatches > 0) {
+                std::cerr << r.replay_mismatches << " lines differed from the trace; stream with the options"
+                          << " it was recorded with." << std::endl;
+            }
+        }
+        unlink(gcode.c_str());
+        unlink(stats.c_str());
+    }
+    rmdir(dir.c_str());
+    return return_code;
+}
@@ -1,85 +1,5171 @@
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view> // for std::string_view
+#include <vector>
+#include <cstdint>
+#include <cstdio>      // for snprintf, perror
 #include <unistd.h>    // for write, read, close, getopt
 #include <getopt.h>    // for getopt_long
 #include <fcntl.h>     // for open
 #include <termios.h>   // for termios
-#include <cstring>     // for memset
+#include <sys/mman.h>  // for mmap
+#include <sys/stat.h>  // for fstat
+#include <cstring>     // for memset, memchr, memmove
+#include <cerrno>      // for errno
 #include <chrono>      // for sleep
 #include <thread>      // for sleep
-#include <algorithm>   // for std::transform
+#include <algorithm>   // for std::min, std::max
+#include <charconv>    // for std::from_chars
+#include <cctype>      // for isalpha, toupper
+#include <cstdlib>     // for strtod
 #include <sys/select.h> // for select
-#include <queue>       // for std::queue
+#include <atomic>      // for std::atomic
+#include <memory>      // for std::unique_ptr
+#include <sys/epoll.h> // for epoll
+#include <csignal>     // for sigaction
+#include <sys/eventfd.h> // for eventfd
+#include <sys/ioctl.h> // for ioctl, TCGETS2, TIOCGSERIAL
+#include <linux/serial.h> // for serial_struct, ASYNC_LOW_LATENCY
+#include <climits>     // for PATH_MAX
+#include <cmath>       // for sqrt, atan2
+#include <sys/wait.h>  // for waitpid
+#include <spawn.h>     // for posix_spawnp
+#include <sys/socket.h> // for socket, accept
+#include <sys/un.h>    // for sockaddr_un
+#include <netdb.h>     // for getaddrinfo
+#include <poll.h>      // for poll
+#include <sys/uio.h>   // for writev
+#include <dirent.h>    // for opendir, readdir
+#if defined(__AVX2__)
+#include <immintrin.h> // for the AVX2 line scan
+#elif defined(__SSE2__)
+#include <emmintrin.h> // for the SSE2 line scan
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>  // for the NEON line scan
+#endif
+
+// Log levels of the streaming loop's -v output
+#define LOG_OFF 0    // No per-line logging
+#define LOG_DEBUG 1  // Controller responses and status reports
+#define LOG_TRACE 2  // Every line sent and every ack
+
+// Most detailed level compiled in; levels above it cost nothing, e.g. build
+// with -DGRBL_LOG_LEVEL=LOG_OFF for a streamer without per-line logging
+#ifndef GRBL_LOG_LEVEL
+#define GRBL_LOG_LEVEL LOG_TRACE
+#endif
 
 // GRBL RX buffer size (effective available space is 127)
 const int RX_BUFFER_SIZE = 127;
 
-// Function to map integer baudrate to speed_t constant
-speed_t get_baudrate(int baud) {
-    switch (baud) {
-        case 50: return B50;
-        case 75: return B75;
-        case 110: return B110;
-        case 134: return B134;
-        case 150: return B150;
-        case 200: return B200;
-        case 300: return B300;
-        case 600: return B600;
-        case 1200: return B1200;
-        case 1800: return B1800;
-        case 2400: return B2400;
-        case 4800: return B4800;
-        case 9600: return B9600;
-        case 19200: return B19200;
-        case 38400: return B38400;
-        case 57600: return B57600;
-        case 115200: return B115200;
-        case 230400: return B230400;
-        default:
-            std::cerr << "Unsupported baudrate: " << baud << std::endl;
-            exit(1);
+// Largest RX window accepted from --rx-buffer or auto-detection
+const int MAX_RX_BUFFER_SIZE = 8192;
+
+// Function to map integer baudrate to speed_t constant. Returns B0 if there
+// is no constant for the rate.
+speed_t get_baudrate(int baud) {
+    switch (baud) {
+        case 50: return B50;
+        case 75: return B75;
+        case 110: return B110;
+        case 134: return B134;
+        case 150: return B150;
+        case 200: return B200;
+        case 300: return B300;
+        case 600: return B600;
+        case 1200: return B1200;
+        case 1800: return B1800;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+#ifdef B460800
+        case 460800: return B460800;
+#endif
+#ifdef B500000
+        case 500000: return B500000;
+#endif
+#ifdef B576000
+        case 576000: return B576000;
+#endif
+#ifdef B921600
+        case 921600: return B921600;
+#endif
+#ifdef B1000000
+        case 1000000: return B1000000;
+#endif
+#ifdef B1152000
+        case 1152000: return B1152000;
+#endif
+#ifdef B1500000
+        case 1500000: return B1500000;
+#endif
+#ifdef B2000000
+        case 2000000: return B2000000;
+#endif
+#ifdef B2500000
+        case 2500000: return B2500000;
+#endif
+#ifdef B3000000
+        case 3000000: return B3000000;
+#endif
+#ifdef B3500000
+        case 3500000: return B3500000;
+#endif
+#ifdef B4000000
+        case 4000000: return B4000000;
+#endif
+        default: return B0;
+    }
+}
+
+// Kernel termios with explicit speeds, for rates that have no B constant.
+// It comes from <asm/termbits.h>, which clashes with <termios.h>.
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+// Function to set an arbitrary baudrate through termios2/BOTHER. Returns the
+// rate the driver settled on (it rounds to its divisor), or -1 if refused.
+int setCustomBaudrate(int fd, int baud) {
+    struct termios2 options;
+    if (ioctl(fd, TCGETS2, &options) != 0) return -1;
+    options.c_cflag &= ~CBAUD;
+    options.c_cflag |= BOTHER;
+    options.c_ispeed = baud;
+    options.c_ospeed = baud;
+    if (ioctl(fd, TCSETS2, &options) != 0 || ioctl(fd, TCGETS2, &options) != 0) return -1;
+    return static_cast<int>(options.c_ospeed);
+}
+
+// Latency timer used on FTDI adapters, in ms (the driver default is 16)
+const int FTDI_LATENCY_TIMER_MS = 1;
+
+// Function to make the driver pass replies on at once: ASYNC_LOW_LATENCY on
+// the port, and on FTDI adapters a short latency timer, which otherwise holds
+// a lone "ok" for up to 16 ms. Best effort; other ports are left alone.
+void setLowLatency(int fd, const char* serial_device, bool verbose) {
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0 && !(serial.flags & ASYNC_LOW_LATENCY)) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &serial) != 0 && verbose) {
+            std::cout << "Could not set low latency mode: " << strerror(errno) << std::endl;
+        }
+    }
+
+    // The timer is a sysfs attribute of the USB serial device behind the tty
+    char real_path[PATH_MAX];
+    if (realpath(serial_device, real_path) == nullptr) return;
+    std::string timer_path = std::string("/sys/class/tty/") + (strrchr(real_path, '/') + 1) +
+                             "/device/latency_timer";
+    int timer_fd = open(timer_path.c_str(), O_RDONLY);
+    if (timer_fd == -1) return;  // Not an FTDI adapter
+    char value[16] = {};
+    ssize_t n = read(timer_fd, value, sizeof(value) - 1);
+    close(timer_fd);
+    if (n <= 0 || atoi(value) <= FTDI_LATENCY_TIMER_MS) return;
+
+    std::string wanted = std::to_string(FTDI_LATENCY_TIMER_MS) + "\n";
+    timer_fd = open(timer_path.c_str(), O_WRONLY);
+    if (timer_fd == -1 || write(timer_fd, wanted.data(), wanted.size()) != static_cast<ssize_t>(wanted.size())) {
+        std::cerr << "Could not lower the FTDI latency timer from " << atoi(value) << " ms (" << timer_path
+                  << "): " << strerror(errno) << std::endl;
+    } else if (verbose) {
+        std::cout << "Lowered the FTDI latency timer from " << atoi(value) << " to " << FTDI_LATENCY_TIMER_MS
+                  << " ms." << std::endl;
+    }
+    if (timer_fd != -1) close(timer_fd);
+}
+
+// Serial trace file (--trace): a TraceFileHeader, then one TraceChunk per
+// read() or write() on a serial port, each followed by its bytes. Times are
+// nanoseconds since start_ns, which is steady (CLOCK_MONOTONIC) time.
+struct TraceFileHeader {
+    char magic[8];      // "GSTRACE1"
+    uint64_t start_ns;
+    uint32_t baud;
+    uint32_t reserved;
+};
+static_assert(sizeof(TraceFileHeader) == 24, "trace header layout");
+
+enum TraceDirection : uint8_t {
+    TRACE_SENT,      // Written to the controller
+    TRACE_RECEIVED,  // Read from the controller
+};
+
+struct TraceChunk {
+    uint64_t time_ns;
+    uint32_t len;
+    TraceDirection direction;
+    uint8_t port;        // Descriptor of the port, to tell several apart
+    uint16_t reserved;
+};
+static_assert(sizeof(TraceChunk) == 16, "trace chunk layout");
+
+// Bytes of trace the I/O thread may run ahead of the writer thread
+const size_t TRACE_RING_SIZE = 4 << 20;
+
+// How often the writer thread appends what has been recorded
+const std::chrono::milliseconds TRACE_FLUSH_INTERVAL{20};
+
+// Recorder of the raw serial traffic. Like AsyncLogger, the I/O thread only
+// copies chunks into a lock-free ring (of bytes here, as chunks vary in
+// size) and a background thread appends them to the file; a chunk that
+// does not fit is dropped and counted, never waited for.
+class TraceRecorder {
+public:
+    TraceRecorder() = default;
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    ~TraceRecorder() { stop(); }
+
+    bool start(const char* path, int baud) {
+        fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ == -1) return false;
+        start_ = std::chrono::steady_clock::now();
+        TraceFileHeader header = {};
+        memcpy(header.magic, "GSTRACE1", 8);
+        header.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start_.time_since_epoch()).count();
+        header.baud = baud;
+        if (write(fd_, &header, sizeof(header)) != sizeof(header)) {
+            close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        ring_.resize(TRACE_RING_SIZE);
+        thread_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    // Append everything recorded so far and end the writer thread. Returns
+    // the number of chunks that were dropped.
+    uint64_t stop() {
+        if (thread_.joinable()) {
+            stopping_.store(true);
+            thread_.join();
+            close(fd_);
+            fd_ = -1;
+        }
+        return dropped_.load();
+    }
+
+    // Producer: record the len bytes moved by one read() or writev() call
+    void record(int port, TraceDirection direction, const struct iovec* iov, int count, size_t len) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (TRACE_RING_SIZE - (head - tail_.load(std::memory_order_acquire)) < sizeof(TraceChunk) + len) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        TraceChunk chunk = {};
+        chunk.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start_).count();
+        chunk.len = static_cast<uint32_t>(len);
+        chunk.direction = direction;
+        chunk.port = static_cast<uint8_t>(port);
+        put(head, &chunk, sizeof(chunk));
+        for (int i = 0; i < count && len > 0; ++i) {
+            size_t part = std::min(len, iov[i].iov_len);
+            put(head, iov[i].iov_base, part);
+            len -= part;
+        }
+        head_.store(head, std::memory_order_release);
+    }
+
+private:
+    // Copy into the ring at pos, wrapping at its end
+    void put(uint64_t& pos, const void* data, size_t len) {
+        size_t at = pos % TRACE_RING_SIZE;
+        size_t first = std::min(len, TRACE_RING_SIZE - at);
+        memcpy(ring_.data() + at, data, first);
+        memcpy(ring_.data(), static_cast<const char*>(data) + first, len - first);
+        pos += len;
+    }
+
+    void run() {
+        while (true) {
+            bool last = stopping_.load();
+            uint64_t tail = tail_.load(std::memory_order_relaxed);
+            uint64_t head = head_.load(std::memory_order_acquire);
+            while (tail < head) {
+                size_t at = tail % TRACE_RING_SIZE;
+                size_t len = std::min<uint64_t>(head - tail, TRACE_RING_SIZE - at);
+                ssize_t n = write(fd_, ring_.data() + at, len);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;  // Disk full or similar; the rest is lost
+                tail += n;
+            }
+            tail_.store(head, std::memory_order_release);
+            if (last) return;
+            std::this_thread::sleep_for(TRACE_FLUSH_INTERVAL);
+        }
+    }
+
+    std::vector<char> ring_;
+    std::atomic<uint64_t> head_{0};  // Bytes recorded
+    std::atomic<uint64_t> tail_{0};  // Bytes written out
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> stopping_{false};
+    std::chrono::steady_clock::time_point start_;
+    int fd_ = -1;
+    std::thread thread_;
+};
+
+// Trace of the serial traffic with --trace, else nullptr
+TraceRecorder* serial_trace = nullptr;
+
+// Function to write to a serial port, recording the bytes with --trace
+ssize_t serialWritev(int fd, const struct iovec* iov, int count) {
+    ssize_t n = writev(fd, iov, count);
+    if (serial_trace != nullptr && n > 0) serial_trace->record(fd, TRACE_SENT, iov, count, n);
+    return n;
+}
+
+ssize_t serialWrite(int fd, const void* data, size_t len) {
+    struct iovec iov = {const_cast<void*>(data), len};
+    return serialWritev(fd, &iov, 1);
+}
+
+// Size of the serial receive buffer. Big enough to hold a burst of responses
+// (a full RX window worth of "ok"s plus status and feedback lines).
+const size_t SERIAL_READ_BUFFER_SIZE = 4096;
+
+// Buffered line reader for the serial port. fill() drains everything the tty
+// has in a single read(); complete lines are handed out as views into the
+// buffer and a trailing partial line is kept for the next call. Lines never
+// wrap: the partial line is moved to the front of the buffer when the free
+// space at the end runs out, so every view is contiguous.
+class SerialLineReader {
+public:
+    explicit SerialLineReader(int fd) : fd_(fd) {}
+
+    // Return the next complete line (including the '\n') if one is buffered.
+    // The view stays valid until the next call to fill().
+    bool nextLine(std::string_view& line) {
+        const char* start = buf_ + head_;
+        const char* nl = static_cast<const char*>(memchr(buf_ + scan_, '\n', tail_ - scan_));
+        if (nl == nullptr) {
+            scan_ = tail_;
+            return false;
+        }
+        line = std::string_view(start, nl + 1 - start);
+        head_ = scan_ = (nl + 1) - buf_;
+        return true;
+    }
+
+    // Read whatever the tty has buffered. Returns the number of bytes read,
+    // 0 on EOF, or -1 on error (errno set, EAGAIN when nothing is ready).
+    ssize_t fill() {
+        if (head_ == tail_) {
+            head_ = tail_ = scan_ = 0;
+        } else if (tail_ == sizeof(buf_)) {
+            if (head_ == 0) {
+                // A single line filled the whole buffer; drop it so the
+                // reader can resynchronise on the next newline.
+                head_ = tail_ = scan_ = 0;
+            } else {
+                memmove(buf_, buf_ + head_, tail_ - head_);
+                tail_ -= head_;
+                scan_ -= head_;
+                head_ = 0;
+            }
+        }
+        ssize_t n = read(fd_, buf_ + tail_, sizeof(buf_) - tail_);
+        if (n > 0) {
+            if (serial_trace != nullptr) {
+                struct iovec iov = {buf_ + tail_, static_cast<size_t>(n)};
+                serial_trace->record(fd_, TRACE_RECEIVED, &iov, 1, n);
+            }
+            tail_ += n;
+        }
+        return n;
+    }
+
+private:
+    int fd_;
+    char buf_[SERIAL_READ_BUFFER_SIZE];
+    size_t head_ = 0;  // Start of the first unconsumed line
+    size_t tail_ = 0;  // End of valid data
+    size_t scan_ = 0;  // Everything before this has been searched for '\n'
+};
+
+// Function to read a line from the serial port (until \n) using polling with select
+// For indefinite wait, timeout_ms is -1. Returns false on timeout, EOF or error.
+// The returned view is valid until the next call.
+bool readSerialLine(SerialLineReader& reader, int fd, std::string_view& line, int timeout_ms = -1) {
+    while (!reader.nextLine(line)) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        int retval = select(fd + 1, &rfds, nullptr, nullptr, timeout_ms < 0 ? nullptr : &tv);
+        if (retval == -1) {
+            if (errno == EINTR) continue;
+            perror("select");
+            return false;
+        } else if (retval == 0) {
+            // Timed out
+            return false;
+        }
+        ssize_t n = reader.fill();
+        if (n == 0) {
+            // EOF
+            return false;
+        } else if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            perror("read");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to trim leading and trailing whitespace from a view
+std::string_view trimWhitespace(std::string_view s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string_view::npos) {
+        return std::string_view();
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+// Longest cleaned G-code line (including the trailing '\n') the streamer sends
+const size_t MAX_LINE_LENGTH = 256;
+
+// Read size used when the G-code input cannot be memory-mapped
+const size_t INGEST_CHUNK_SIZE = 1 << 20;
+
+// Variants of line cleaning, chosen once per input. Each combination is
+// its own instantiation of the cleaning kernel, so the per-byte work has no
+// run-time tests of the options.
+enum CleanFlags : unsigned {
+    CLEAN_DEFAULT = 0,        // Drop comments and leading/trailing whitespace
+    CLEAN_KEEP_COMMENTS = 1,  // Send ';' and '( )' comments on to the controller
+    CLEAN_UPPERCASE = 2,      // Uppercase everything outside comments
+    CLEAN_STRIP_SPACES = 4,   // Remove spaces and tabs inside lines too
+    CLEAN_VARIANTS = 8
+};
+
+// Function to tell whether a byte means a line cannot be sent as it is
+template<unsigned Flags>
+inline bool cleaningByte(unsigned char c) {
+    bool hit = false;
+    if constexpr (!(Flags & CLEAN_KEEP_COMMENTS)) hit |= (c == ';' || c == '(');
+    if constexpr ((Flags & CLEAN_UPPERCASE) != 0) hit |= (static_cast<unsigned>(c - 'a') < 26);
+    if constexpr ((Flags & CLEAN_STRIP_SPACES) != 0) hit |= (c == ' ' || c == '\t');
+    return hit;
+}
+
+// Function to classify one block of input: a mask of its newlines and one of
+// the bytes cleaningByte() matches. Each byte has SCAN_BITS bits in a mask.
+#if defined(__AVX2__)
+const size_t SCAN_BLOCK = 32;
+const int SCAN_BITS = 1;
+
+template<unsigned Flags>
+inline void scanBlock(const char* s, uint64_t& newlines, uint64_t& hits) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+    __m256i hit = _mm256_setzero_si256();
+    if constexpr (!(Flags & CLEAN_KEEP_COMMENTS)) {
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+    }
+    if constexpr ((Flags & CLEAN_UPPERCASE) != 0) {
+        // 'a'..'z' moved to the bottom of the signed range
+        __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(static_cast<char>(128 - 'a')));
+        hit = _mm256_or_si256(hit, _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted));
+    }
+    if constexpr ((Flags & CLEAN_STRIP_SPACES) != 0) {
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    }
+    newlines = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+    hits = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+}
+#elif defined(__SSE2__)
+const size_t SCAN_BLOCK = 16;
+const int SCAN_BITS = 1;
+
+template<unsigned Flags>
+inline void scanBlock(const char* s, uint64_t& newlines, uint64_t& hits) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    __m128i hit = _mm_setzero_si128();
+    if constexpr (!(Flags & CLEAN_KEEP_COMMENTS)) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+    }
+    if constexpr ((Flags & CLEAN_UPPERCASE) != 0) {
+        // 'a'..'z' moved to the bottom of the signed range
+        __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(static_cast<char>(128 - 'a')));
+        hit = _mm_or_si128(hit, _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26)));
+    }
+    if constexpr ((Flags & CLEAN_STRIP_SPACES) != 0) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    }
+    newlines = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    hits = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+}
+#elif defined(__ARM_NEON)
+const size_t SCAN_BLOCK = 16;
+const int SCAN_BITS = 4;
+
+// Function to narrow a byte mask to 4 bits per byte (NEON has no movemask)
+inline uint64_t neonMask(uint8x16_t mask) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+}
+
+template<unsigned Flags>
+inline void scanBlock(const char* s, uint64_t& newlines, uint64_t& hits) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s));
+    uint8x16_t hit = vdupq_n_u8(0);
+    if constexpr (!(Flags & CLEAN_KEEP_COMMENTS)) {
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(';')));
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('(')));
+    }
+    if constexpr ((Flags & CLEAN_UPPERCASE) != 0) {
+        hit = vorrq_u8(hit, vcltq_u8(vsubq_u8(v, vdupq_n_u8('a')), vdupq_n_u8(26)));
+    }
+    if constexpr ((Flags & CLEAN_STRIP_SPACES) != 0) {
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(' ')));
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('\t')));
+    }
+    newlines = neonMask(vceqq_u8(v, vdupq_n_u8('\n')));
+    hits = neonMask(hit);
+}
+#else
+const size_t SCAN_BLOCK = 8;
+const int SCAN_BITS = 1;
+
+template<unsigned Flags>
+inline void scanBlock(const char* s, uint64_t& newlines, uint64_t& hits) {
+    newlines = 0;
+    hits = 0;
+    for (size_t i = 0; i < SCAN_BLOCK; ++i) {
+        newlines |= static_cast<uint64_t>(s[i] == '\n') << i;
+        hits |= static_cast<uint64_t>(cleaningByte<Flags>(s[i])) << i;
+    }
+}
+#endif
+
+// Function to clean one raw G-code line: drops ';' and '( )' comments and
+// leading/trailing whitespace, as adjusted by Flags. Writes at most cap
+// bytes to out and returns the cleaned length (which may exceed cap if the
+// line does not fit).
+template<unsigned Flags>
+size_t cleanGcodeLine(const char* src, size_t len, char* out, size_t cap) {
+    constexpr bool keep_comments = (Flags & CLEAN_KEEP_COMMENTS) != 0;
+    size_t n = 0;
+    size_t last_non_space = 0;  // Cleaned length up to the last non-whitespace byte
+    bool in_paren = false;
+    auto put = [&](char c) {
+        if (n < cap) out[n] = c;
+        ++n;
+        last_non_space = n;
+    };
+    for (size_t i = 0; i < len; ++i) {
+        char c = src[i];
+        if (in_paren) {
+            if constexpr (keep_comments) put(c);
+            if (c == ')') in_paren = false;
+            continue;
+        }
+        if (c == ';') {
+            if constexpr (keep_comments) {
+                // The rest of the line is the comment, kept as written
+                for (; i < len; ++i) {
+                    if (src[i] == ' ' || src[i] == '\t' || src[i] == '\r') {
+                        if (n < cap) out[n] = src[i];
+                        ++n;
+                    } else {
+                        put(src[i]);
+                    }
+                }
+            }
+            break;
+        }
+        if (c == '(') {
+            in_paren = true;
+            if constexpr (keep_comments) put(c);
+            continue;
+        }
+        bool space = (c == ' ' || c == '\t' || c == '\r');
+        if (space) {
+            if constexpr ((Flags & CLEAN_STRIP_SPACES) != 0) continue;
+            if (n == 0) continue;
+            if (n < cap) out[n] = c;
+            ++n;
+            continue;
+        }
+        if constexpr ((Flags & CLEAN_UPPERCASE) != 0) {
+            if (static_cast<unsigned>(c - 'a') < 26) c = static_cast<char>(c - 'a' + 'A');
+        }
+        put(c);
+    }
+    return last_non_space;
+}
+
+// One cleaned G-code line ready to be sent
+struct GcodeLine {
+    std::string_view text;  // Cleaned line including the trailing '\n'
+    uint64_t line_number;   // 1-based line number in the source file
+    uint64_t offset;        // Byte offset of the source line in the file
+};
+
+// Compressed input formats, recognised by their magic bytes, and the program
+// that decompresses them from stdin to stdout with -dc
+struct Decompressor {
+    const char* magic;
+    size_t magic_len;
+    const char* program;
+};
+
+const Decompressor DECOMPRESSORS[] = {
+    {"\x1f\x8b", 2, "gzip"},
+    {"\x28\xb5\x2f\xfd", 4, "zstd"},
+};
+
+// Function to tell whether a G-code path names a socket to listen on:
+// "tcp:[host:]port" or "unix:path"
+bool isSocketInput(std::string_view path) {
+    return path.substr(0, 4) == "tcp:" || path.substr(0, 5) == "unix:";
+}
+
+// Streaming G-code ingest. Regular files are memory-mapped; anything else
+// (stdin as "-", a named pipe, a socket) is read in large chunks. gzip and
+// zstd files are read through a decompressor process, which keeps filling a
+// pipe while the parser works. Each line is cleaned exactly once: lines that
+// need no cleaning are handed out as views straight into the mapping, the
+// rest are cleaned into a small sent-form buffer. There is never any seeking
+// back.
+class GcodeIngest {
+public:
+    GcodeIngest() = default;
+    GcodeIngest(const GcodeIngest&) = delete;
+    GcodeIngest& operator=(const GcodeIngest&) = delete;
+
+    ~GcodeIngest() {
+        if (map_ != nullptr) munmap(map_, map_size_);
+        if (fd_ != -1) close(fd_);
+        if (cancel_event_ != -1) close(cancel_event_);
+        if (decompressor_ != -1) {
+            kill(decompressor_, SIGTERM);  // Input abandoned before its end
+            waitpid(decompressor_, nullptr, 0);
+        }
+    }
+
+    bool open(const char* path) {
+        if (isSocketInput(path)) return acceptConnection(path);
+        fd_ = (strcmp(path, "-") == 0) ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0) : ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd_ == -1) {
+            error_ = strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            char magic[4] = {};
+            ssize_t n = pread(fd_, magic, sizeof(magic), 0);
+            for (const Decompressor& format : DECOMPRESSORS) {
+                if (n >= static_cast<ssize_t>(format.magic_len) && memcmp(magic, format.magic, format.magic_len) == 0) {
+                    return startDecompressor(format.program);
+                }
+            }
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                map_ = map;
+                map_size_ = st.st_size;
+                data_ = static_cast<const char*>(map);
+                end_ = map_size_;
+                eof_ = true;
+                return true;
+            }
+        }
+        // Not mappable (pipe, empty file, ...): fall back to chunked reads
+        startChunkedReads();
+        return true;
+    }
+
+    // Produce lines from a slice of memory the caller keeps alive (a part
+    // of another ingest's mapping). Offsets start at offset, line numbers at 1.
+    void attach(std::string_view data, uint64_t offset) {
+        data_ = data.data();
+        end_ = data.size();
+        base_offset_ = offset;
+        eof_ = true;
+    }
+
+    // The whole file if it is memory-mapped, else empty
+    std::string_view mapped() const {
+        return std::string_view(map_ != nullptr ? static_cast<const char*>(map_) : nullptr, map_size_);
+    }
+
+    // Number of the last source line read
+    uint64_t lineNumber() const { return line_number_; }
+
+    // Descriptor the input is read from (the client socket in bridge mode)
+    int fd() const { return fd_; }
+
+    // Make a read that waits for streamed input give up; next() then fails.
+    // Safe to call from another thread.
+    void cancel() {
+        uint64_t one = 1;
+        if (cancel_event_ != -1) write(cancel_event_, &one, sizeof(one));
+    }
+
+    // Clean lines with the given CleanFlags (the default drops comments)
+    void setCleaning(unsigned flags) {
+        next_ = NEXT_VARIANTS[flags % CLEAN_VARIANTS];
+    }
+
+    // Produce the next non-empty cleaned line. The line's text stays valid
+    // until the next call. Returns false at end of input or on error.
+    bool next(GcodeLine& line) { return (this->*next_)(line); }
+
+    // Continue from the source line starting at offset, numbered line_number.
+    // Only memory-mapped input can seek. Returns false if offset is invalid.
+    bool seek(uint64_t offset, uint64_t line_number) {
+        if (map_ == nullptr || offset > map_size_) return false;
+        pos_ = offset;
+        line_number_ = line_number - 1;
+        scan_valid_ = false;
+        return true;
+    }
+
+    // Description of the last error, or nullptr if input ended normally
+    const char* error() const { return error_; }
+
+private:
+    // Read fd_ in chunks instead of mapping it
+    void startChunkedReads() {
+        chunk_.resize(INGEST_CHUNK_SIZE);
+        data_ = chunk_.data();
+        cancel_event_ = eventfd(0, EFD_CLOEXEC);
+    }
+
+    // Listen on a "tcp:[host:]port" or "unix:path" socket and read the G-code
+    // sent by the first peer that connects, until it closes the connection
+    bool acceptConnection(std::string_view spec) {
+        int listener = -1;
+        std::string unix_path;
+        if (spec.substr(0, 5) == "unix:") {
+            unix_path = spec.substr(5);
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (unix_path.size() >= sizeof(addr.sun_path)) {
+                error_ = "socket path too long";
+                return false;
+            }
+            memcpy(addr.sun_path, unix_path.c_str(), unix_path.size());
+            struct stat st;
+            if (stat(unix_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(unix_path.c_str());  // Stale
+            listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listener != -1 && bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+                close(listener);
+                listener = -1;
+            }
+        } else {
+            std::string address(spec.substr(4));
+            size_t colon = address.rfind(':');
+            std::string host = (colon == std::string::npos) ? "" : address.substr(0, colon);
+            std::string port = address.substr(colon == std::string::npos ? 0 : colon + 1);
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            struct addrinfo* addresses = nullptr;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+                error_ = "cannot resolve the listen address";
+                return false;
+            }
+            for (struct addrinfo* ai = addresses; ai != nullptr && listener == -1; ai = ai->ai_next) {
+                listener = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+                if (listener == -1) continue;
+                int reuse = 1;
+                setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                if (bind(listener, ai->ai_addr, ai->ai_addrlen) != 0) {
+                    close(listener);
+                    listener = -1;
+                }
+            }
+            freeaddrinfo(addresses);
+        }
+        if (listener == -1 || listen(listener, 1) != 0) {
+            error_ = strerror(errno);
+            if (listener != -1) close(listener);
+            return false;
+        }
+        do {
+            fd_ = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        } while (fd_ == -1 && errno == EINTR);
+        if (fd_ == -1) error_ = strerror(errno);
+        close(listener);
+        if (!unix_path.empty()) unlink(unix_path.c_str());
+        if (fd_ == -1) return false;
+        startChunkedReads();
+        return true;
+    }
+
+    // Replace the file by the output of "program -dc < file"
+    bool startDecompressor(const char* program) {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            error_ = strerror(errno);
+            return false;
+        }
+        fcntl(pipe_fds[0], F_SETPIPE_SZ, static_cast<int>(INGEST_CHUNK_SIZE));  // Let it run ahead
+        // posix_spawnp rather than fork: the other threads may hold locks,
+        // and every other descriptor (the serial port included) is close-on-exec
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fd_, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        char* argv[] = {const_cast<char*>(program), const_cast<char*>("-dc"), nullptr};
+        pid_t pid;
+        int spawned = posix_spawnp(&pid, program, &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(pipe_fds[1]);
+        if (spawned != 0) {
+            close(pipe_fds[0]);
+            if (spawned == ENOENT) {
+                snprintf(error_buf_, sizeof(error_buf_), "%s not found", program);
+                error_ = error_buf_;
+            } else {
+                error_ = strerror(spawned);
+            }
+            return false;
+        }
+        close(fd_);
+        fd_ = pipe_fds[0];
+        decompressor_ = pid;
+        decompressor_name_ = program;
+        startChunkedReads();
+        return true;
+    }
+
+    // Collect the decompressor at end of input. Returns false if it failed,
+    // in which case the input is incomplete.
+    bool finishDecompressor() {
+        int status = 0;
+        waitpid(decompressor_, &status, 0);
+        decompressor_ = -1;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            snprintf(error_buf_, sizeof(error_buf_), "%s not found", decompressor_name_);
+        } else {
+            snprintf(error_buf_, sizeof(error_buf_), "%s failed to decompress the input", decompressor_name_);
+        }
+        error_ = error_buf_;
+        return false;
+    }
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    // Find the end of the line at pos_; each block of input is classified
+    // once, and its masks carry over to the lines after it. Returns the
+    // line's length up to its '\n', or all that is left if there is none;
+    // dirty is set if the line has a byte cleaningByte() matches.
+    template<unsigned Flags>
+    size_t findLineEnd(bool& dirty) {
+        size_t i = pos_;
+        uint64_t hits_seen = 0;
+        while (true) {
+            if (!scan_valid_ || i >= scan_pos_ + SCAN_BLOCK) {
+                if (i + SCAN_BLOCK > end_) break;  // The tail is scanned a byte at a time
+                scanBlock<Flags>(data_ + i, scan_newlines_, scan_hits_);
+                scan_pos_ = i;
+                scan_valid_ = true;
+            }
+            uint64_t from = ~((uint64_t(1) << ((i - scan_pos_) * SCAN_BITS)) - 1);
+            uint64_t newlines = scan_newlines_ & from;
+            if (newlines != 0) {
+                int at = __builtin_ctzll(newlines);
+                dirty = (hits_seen | (scan_hits_ & from & ((uint64_t(1) << at) - 1))) != 0;
+                return scan_pos_ + at / SCAN_BITS - pos_;
+            }
+            hits_seen |= scan_hits_ & from;
+            i = scan_pos_ + SCAN_BLOCK;
+        }
+        bool hit = hits_seen != 0;
+        for (; i < end_ && data_[i] != '\n'; ++i) hit |= cleaningByte<Flags>(data_[i]);
+        dirty = hit;
+        return i - pos_;
+    }
+
+    // next() for one cleaning variant. A line without a byte to clean and
+    // without surrounding whitespace is handed out as it is.
+    template<unsigned Flags>
+    bool nextLine(GcodeLine& line) {
+        while (true) {
+            const char* start = data_ + pos_;
+            size_t avail = end_ - pos_;
+            bool dirty;
+            size_t raw_len = findLineEnd<Flags>(dirty);
+            bool newline = raw_len < avail;
+            if (!newline && !eof_) {
+                if (!refill()) return false;
+                continue;
+            }
+            if (avail == 0) return false;
+
+            line.offset = base_offset_ + pos_;
+            line.line_number = ++line_number_;
+            pos_ += raw_len + (newline ? 1 : 0);
+
+            if (newline && !dirty && raw_len > 0 && !isSpace(start[0]) && !isSpace(start[raw_len - 1])) {
+                if (raw_len + 1 > MAX_LINE_LENGTH) return lineTooLong(line);
+                line.text = std::string_view(start, raw_len + 1);
+                return true;
+            }
+            size_t len = cleanGcodeLine<Flags>(start, raw_len, out_, MAX_LINE_LENGTH - 1);
+            if (len == 0) continue;  // Blank or comment-only line
+            if (len + 1 > MAX_LINE_LENGTH) return lineTooLong(line);
+            out_[len] = '\n';
+            line.text = std::string_view(out_, len + 1);
+            return true;
+        }
+    }
+
+
+    using NextFunction = bool (GcodeIngest::*)(GcodeLine&);
+    static constexpr NextFunction NEXT_VARIANTS[CLEAN_VARIANTS] = {
+        &GcodeIngest::nextLine<0>, &GcodeIngest::nextLine<1>, &GcodeIngest::nextLine<2>, &GcodeIngest::nextLine<3>,
+        &GcodeIngest::nextLine<4>, &GcodeIngest::nextLine<5>, &GcodeIngest::nextLine<6>, &GcodeIngest::nextLine<7>,
+    };
+
+    bool lineTooLong(const GcodeLine& line) {
+        snprintf(error_buf_, sizeof(error_buf_), "line %llu exceeds %zu bytes",
+                 static_cast<unsigned long long>(line.line_number), MAX_LINE_LENGTH);
+        error_ = error_buf_;
+        return false;
+    }
+
+    // Read the next chunk in stream mode, keeping the unconsumed partial line
+    bool refill() {
+        size_t keep = end_ - pos_;
+        memmove(chunk_.data(), chunk_.data() + pos_, keep);
+        base_offset_ += pos_;
+        pos_ = 0;
+        end_ = keep;
+        scan_valid_ = false;  // The blocks moved
+        if (end_ == chunk_.size()) {
+            chunk_.resize(chunk_.size() * 2);  // Line longer than a chunk (long comment)
+        }
+        data_ = chunk_.data();
+        while (true) {
+            // A generator may keep the input open for a long time between lines
+            struct pollfd fds[2] = {{fd_, POLLIN, 0}, {cancel_event_, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                error_ = strerror(errno);
+                return false;
+            }
+            if (fds[1].revents & POLLIN) {
+                error_ = "input cancelled";
+                return false;
+            }
+            ssize_t n = read(fd_, chunk_.data() + end_, chunk_.size() - end_);
+            if (n > 0) {
+                end_ += n;
+            } else if (n == 0) {
+                eof_ = true;
+                if (decompressor_ != -1 && !finishDecompressor()) return false;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                error_ = strerror(errno);
+                return false;
+            }
+            return true;
+        }
+    }
+
+    int fd_ = -1;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    std::vector<char> chunk_;
+    const char* data_ = nullptr;  // Mapping or chunk buffer
+    size_t pos_ = 0;              // Next unconsumed byte in data_
+    size_t end_ = 0;              // End of valid bytes in data_
+    uint64_t base_offset_ = 0;    // File offset of data_[0]
+    uint64_t line_number_ = 0;
+    size_t scan_pos_ = 0;         // Start of the last block scanned in data_
+    uint64_t scan_newlines_ = 0;  // Its masks from scanBlock()
+    uint64_t scan_hits_ = 0;
+    bool scan_valid_ = false;
+    bool eof_ = false;
+    const char* error_ = nullptr;
+    char error_buf_[64];
+    char out_[MAX_LINE_LENGTH];
+    pid_t decompressor_ = -1;
+    const char* decompressor_name_ = nullptr;
+    int cancel_event_ = -1;
+    NextFunction next_ = &GcodeIngest::nextLine<CLEAN_DEFAULT>;
+};
+
+// One word of a cleaned G-code line, e.g. "X-1.5"
+struct GcodeWord {
+    char letter;      // Uppercased letter
+    const char* num;  // Number as written in the line
+    size_t len;       // Length of num
+    double value;
+};
+
+// Function to parse the word at pos, skipping spaces and the comments
+// --keep-comments leaves in, as GRBL does. Returns false at the end of the
+// line or when the text is not a plain letter and number; pos is then left at
+// the end of the line or at the offending character.
+bool parseGcodeWord(std::string_view line, size_t& pos, GcodeWord& word) {
+    size_t i = pos;
+    while (i < line.size()) {
+        if (line[i] == ' ' || line[i] == '\t') {
+            ++i;
+        } else if (line[i] == ';') {
+            i = line.size();
+        } else if (line[i] == '(' && line.find(')', i) != std::string_view::npos) {
+            i = line.find(')', i) + 1;
+        } else {
+            break;
+        }
+    }
+    pos = i;
+    if (i == line.size() || !isalpha(static_cast<unsigned char>(line[i]))) return false;
+    char letter = static_cast<char>(toupper(static_cast<unsigned char>(line[i++])));
+    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) ++i;
+    size_t num = i;
+    if (i < line.size() && (line[i] == '-' || line[i] == '+')) ++i;
+    size_t digits = 0;
+    while (i < line.size() && (isdigit(static_cast<unsigned char>(line[i])) || line[i] == '.')) {
+        if (line[i] != '.') ++digits;
+        ++i;
+    }
+    if (digits == 0 || i - num >= 32) return false;
+    char tmp[32];
+    memcpy(tmp, line.data() + num, i - num);
+    tmp[i - num] = '\0';
+    word = {letter, line.data() + num, i - num, strtod(tmp, nullptr)};
+    pos = i;
+    return true;
+}
+
+// Function to get a G or M word's code as ten times its number (G38.2 -> 382)
+int gcodeCode(const GcodeWord& word) {
+    return static_cast<int>(word.value * 10 + 0.5);
+}
+
+// Default number of decimals kept on coordinate words in compact mode
+const int DEFAULT_COMPACT_PRECISION = 4;
+
+// Most words a single line may have for compaction (longer lines pass through)
+const size_t MAX_COMPACT_WORDS = 32;
+
+// Optional wire-size compaction of cleaned G-code lines. Removes spaces,
+// uppercases, drops modal words that repeat the current state (motion mode,
+// unchanged F) and normalises numbers: leading/trailing zeros are trimmed and
+// coordinates are rounded to the configured number of decimals. Lines it does
+// not understand ('$' commands, anything that is not plain words) are sent
+// unchanged, and so are lines with comments kept in, after updating the state.
+class GcodeCompactor {
+public:
+    explicit GcodeCompactor(int precision) : precision_(precision) {}
+
+    // Rewrite line.text in compact form. Returns false if nothing is left to send.
+    bool apply(GcodeLine& line) {
+        std::string_view in = line.text.substr(0, line.text.size() - 1);
+        bytes_in_ += line.text.size();
+
+        GcodeWord words[MAX_COMPACT_WORDS];
+        size_t count = 0;
+        size_t pos = 0;
+        while (count < MAX_COMPACT_WORDS && parseGcodeWord(in, pos, words[count])) ++count;
+        if (pos != in.size()) return passThrough(line);
+
+        // Feed rate mode changes apply to the F word on the same line
+        bool program_end = false;
+        for (size_t w = 0; w < count; ++w) {
+            int code = gcodeCode(words[w]);
+            if (words[w].letter == 'G' && (code == 930 || code == 940)) {
+                bool inverse = (code == 930);
+                if (inverse != inverse_time_) feed_ = -1;
+                inverse_time_ = inverse;
+            } else if (words[w].letter == 'M' && (code == 20 || code == 300)) {
+                program_end = true;
+            }
+        }
+
+        size_t n = 0;
+        for (size_t w = 0; w < count; ++w) {
+            const GcodeWord& word = words[w];
+            if (word.letter == 'G') {
+                int code = gcodeCode(word);
+                if (isMotionMode(code)) {
+                    if (code == motion_) continue;
+                    motion_ = code;
+                }
+            } else if (word.letter == 'F') {
+                if (!inverse_time_ && word.value == feed_) continue;
+                feed_ = word.value;
+            }
+            char num[64];
+            size_t len = formatNumber(word, isCoordinate(word.letter), num);
+            if (n + 1 + len > MAX_LINE_LENGTH - 1) return passThrough(line);
+            out_[n++] = word.letter;
+            memcpy(out_ + n, num, len);
+            n += len;
+        }
+        if (program_end) {
+            // M2/M30 reset the modal state on the controller
+            motion_ = -1;
+            feed_ = -1;
+            inverse_time_ = false;
+        }
+        if (in.find_first_of("(;") != std::string_view::npos) return passThrough(line);
+        if (n == 0) return false;
+        out_[n++] = '\n';
+        line.text = std::string_view(out_, n);
+        bytes_out_ += n;
+        return true;
+    }
+
+    uint64_t bytesIn() const { return bytes_in_; }
+    uint64_t bytesOut() const { return bytes_out_; }
+
+private:
+    bool passThrough(GcodeLine& line) {
+        bytes_out_ += line.text.size();
+        return true;
+    }
+
+    // G0, G1, G2, G3, G38.2-G38.5 and G80 (codes are G number x10)
+    static bool isMotionMode(int code) {
+        return code == 0 || code == 10 || code == 20 || code == 30 ||
+               (code >= 382 && code <= 385) || code == 800;
+    }
+
+    static bool isCoordinate(char letter) {
+        switch (letter) {
+            case 'X': case 'Y': case 'Z': case 'A': case 'B': case 'C':
+            case 'I': case 'J': case 'K': case 'R':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Format a word's number without '+', leading or trailing zeros, rounding
+    // coordinates to the configured precision. Returns the length written.
+    size_t formatNumber(const GcodeWord& word, bool coordinate, char* out) const {
+        char rounded[64];
+        const char* s = word.num;
+        size_t len = word.len;
+        const char* dot = static_cast<const char*>(memchr(s, '.', len));
+        if (coordinate && dot != nullptr && static_cast<int>(s + len - dot - 1) > precision_) {
+            len = snprintf(rounded, sizeof(rounded), "%.*f", precision_, word.value);
+            s = rounded;
+        }
+
+        size_t i = 0;
+        bool negative = false;
+        if (i < len && (s[i] == '-' || s[i] == '+')) negative = (s[i++] == '-');
+        while (i < len && s[i] == '0') ++i;
+        size_t int_start = i;
+        while (i < len && s[i] != '.') ++i;
+        size_t int_end = i;
+        size_t frac_start = (i < len) ? i + 1 : len;
+        size_t frac_end = len;
+        while (frac_end > frac_start && s[frac_end - 1] == '0') --frac_end;
+
+        size_t n = 0;
+        if (int_start == int_end && frac_start == frac_end) {
+            out[n++] = '0';  // Zero, including "-0.000"
+            return n;
+        }
+        if (negative) out[n++] = '-';
+        memcpy(out + n, s + int_start, int_end - int_start);
+        n += int_end - int_start;
+        if (frac_end > frac_start) {
+            out[n++] = '.';
+            memcpy(out + n, s + frac_start, frac_end - frac_start);
+            n += frac_end - frac_start;
+        }
+        return n;
+    }
+
+    int precision_;
+    int motion_ = -1;            // Current motion mode (G number x10), -1 if unknown
+    double feed_ = -1;           // Last F value sent, negative if unknown
+    bool inverse_time_ = false;  // G93: F must be repeated on every line
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+    char out_[MAX_LINE_LENGTH];
+};
+
+// Most axes reported in a status report position field
+const int MAX_AXES = 6;
+
+// Last known machine status, updated in place from '<...>' status reports.
+// Fields keep their previous value when a report omits them (GRBL only sends
+// WCO and Ov every few reports).
+struct GrblStatus {
+    char state[16] = "";        // Idle, Run, Hold:0, Alarm, ...
+    int axes = 0;               // Number of axes in the position fields
+    double mpos[MAX_AXES] = {}; // Machine position
+    double wpos[MAX_AXES] = {}; // Work position
+    double wco[MAX_AXES] = {};  // Work coordinate offset
+    bool has_mpos = false;
+    bool has_wpos = false;
+    int planner_free = -1;      // Bf: free planner blocks, -1 if unknown
+    int rx_free = -1;           // Bf: free RX buffer bytes, -1 if unknown
+    double feed = -1;           // FS:/F: current feed rate
+    double spindle = -1;        // FS: current spindle speed
+    long line_number = -1;      // Ln: line number being executed
+    int overrides[3] = {100, 100, 100};  // Ov: feed, rapid, spindle (%)
+    uint64_t reports = 0;       // Number of reports parsed so far
+};
+
+// Function to parse a comma separated list of numbers from a status field.
+// Returns the number of values parsed.
+int parseStatusNumbers(std::string_view field, double* values, int max_values) {
+    int count = 0;
+    const char* p = field.data();
+    const char* end = p + field.size();
+    while (p < end && count < max_values) {
+        auto result = std::from_chars(p, end, values[count]);
+        if (result.ec != std::errc()) break;
+        ++count;
+        p = result.ptr;
+        if (p < end && *p == ',') ++p;
+    }
+    return count;
+}
+
+// Function to parse a GRBL status report ("<Idle|MPos:0.000,0.000,0.000|FS:0,0>")
+// into status without allocating. Returns false if report is not a status report.
+bool parseStatusReport(std::string_view report, GrblStatus& status) {
+    if (report.size() < 2 || report.front() != '<' || report.back() != '>') return false;
+    report = report.substr(1, report.size() - 2);
+
+    bool first = true;
+    while (!report.empty()) {
+        size_t bar = report.find('|');
+        std::string_view field = report.substr(0, bar);
+        report = (bar == std::string_view::npos) ? std::string_view() : report.substr(bar + 1);
+
+        if (first) {
+            size_t n = std::min(field.size(), sizeof(status.state) - 1);
+            memcpy(status.state, field.data(), n);
+            status.state[n] = '\0';
+            first = false;
+            continue;
+        }
+        size_t colon = field.find(':');
+        if (colon == std::string_view::npos) continue;
+        std::string_view key = field.substr(0, colon);
+        std::string_view value = field.substr(colon + 1);
+        double numbers[MAX_AXES];
+
+        if (key == "MPos") {
+            status.axes = parseStatusNumbers(value, status.mpos, MAX_AXES);
+            status.has_mpos = true;
+            status.has_wpos = false;
+        } else if (key == "WPos") {
+            status.axes = parseStatusNumbers(value, status.wpos, MAX_AXES);
+            status.has_wpos = true;
+            status.has_mpos = false;
+        } else if (key == "WCO") {
+            parseStatusNumbers(value, status.wco, MAX_AXES);
+        } else if (key == "Bf") {
+            if (parseStatusNumbers(value, numbers, 2) == 2) {
+                status.planner_free = static_cast<int>(numbers[0]);
+                status.rx_free = static_cast<int>(numbers[1]);
+            }
+        } else if (key == "FS") {
+            int n = parseStatusNumbers(value, numbers, 2);
+            if (n > 0) status.feed = numbers[0];
+            if (n > 1) status.spindle = numbers[1];
+        } else if (key == "F") {
+            if (parseStatusNumbers(value, numbers, 1) == 1) status.feed = numbers[0];
+        } else if (key == "Ln") {
+            if (parseStatusNumbers(value, numbers, 1) == 1) status.line_number = static_cast<long>(numbers[0]);
+        } else if (key == "Ov") {
+            if (parseStatusNumbers(value, numbers, 3) == 3) {
+                for (int i = 0; i < 3; ++i) status.overrides[i] = static_cast<int>(numbers[i]);
+            }
+        }
+    }
+    ++status.reports;
+    return true;
+}
+
+// Kinds of line GRBL sends
+enum ResponseKind {
+    RESPONSE_OTHER,     // Anything else (startup line echoes ">...:ok", ...)
+    RESPONSE_OK,        // "ok": the oldest pending line was accepted
+    RESPONSE_ERROR,     // "error:N": the oldest pending line was rejected
+    RESPONSE_ALARM,     // "ALARM:N": the controller locked up
+    RESPONSE_STATUS,    // "<...>" status report
+    RESPONSE_FEEDBACK,  // "[MSG:...]", "[GC:...]" and other bracketed messages
+    RESPONSE_SETTING,   // "$N=value" setting line
+    RESPONSE_BANNER,    // "Grbl x.y ['$' for help]" printed after a reset
+};
+
+// A classified response line. code is the N of error:N and ALARM:N (0 if
+// the controller sent text instead, as GRBL 0.9 does).
+struct Response {
+    ResponseKind kind = RESPONSE_OTHER;
+    int code = 0;
+};
+
+// Function to classify a trimmed response line in one pass, without allocating
+Response classifyResponse(std::string_view line) {
+    Response response;
+    if (line.empty()) return response;
+    std::string_view code;
+    switch (line.front()) {
+        case 'o':
+            if (line == "ok") response.kind = RESPONSE_OK;
+            break;
+        case 'e':
+            if (line.substr(0, 6) == "error:") {
+                response.kind = RESPONSE_ERROR;
+                code = line.substr(6);
+            }
+            break;
+        case 'A':
+            if (line.substr(0, 6) == "ALARM:") {
+                response.kind = RESPONSE_ALARM;
+                code = line.substr(6);
+            }
+            break;
+        case '<':
+            response.kind = RESPONSE_STATUS;
+            break;
+        case '[':
+            if (line.back() == ']') response.kind = RESPONSE_FEEDBACK;
+            break;
+        case '$':
+            response.kind = RESPONSE_SETTING;
+            break;
+        case 'G':
+            if (line.substr(0, 4) == "Grbl") response.kind = RESPONSE_BANNER;
+            break;
+    }
+    if (!code.empty()) std::from_chars(code.data(), code.data() + code.size(), response.code);
+    return response;
+}
+
+// Most G1 segments the coalescer holds while looking for a longer fit
+const size_t MAX_COALESCE_POINTS = 256;
+
+// Decimals written on coordinates of merged lines and arcs (in mm; one
+// more in inch mode)
+const int COALESCE_PRECISION = 4;
+
+// Optional toolpath simplification ahead of the send loop. Runs of plain
+// "G1 X Y Z" moves (absolute, units/min feed, unchanged F) are merged into a
+// single G1 while every dropped point stays within the tolerance of it, and
+// runs that curve are fitted with one G2/G3 arc in the XY plane under the
+// same bound. Everything else passes through unchanged; it ends the run.
+class SegmentCoalescer {
+public:
+    // tolerance is the largest deviation from the original path, in mm
+    SegmentCoalescer(double tolerance, bool arcs) : tolerance_(tolerance), arcs_(arcs) {}
+
+    // Feed the next cleaned source line
+    void push(const GcodeLine& line) {
+        if (ready_pos_ == ready_.size()) {
+            ready_.clear();
+            ready_pos_ = 0;
+        }
+        lines_in_ += 1;
+        bytes_in_ += line.text.size();
+
+        double target[3];
+        if (!coalescable(line.text, target)) {
+            flush();
+            emitSource(line.text, line.line_number, line.offset, track(line.text));
+            return;
+        }
+        motion_ = 10;
+        extend({{target[0], target[1], target[2]}, std::string(line.text), line.line_number, line.offset});
+    }
+
+    // End of input: emit the run still held
+    void finish() {
+        if (ready_pos_ == ready_.size()) {
+            ready_.clear();
+            ready_pos_ = 0;
+        }
+        flush();
+    }
+
+    // Take the next line ready to send. Its text stays valid until the next
+    // push() or finish().
+    bool pop(GcodeLine& line) {
+        if (ready_pos_ == ready_.size()) return false;
+        const Ready& ready = ready_[ready_pos_++];
+        line.text = ready.text;
+        line.line_number = ready.line_number;
+        line.offset = ready.offset;
+        return true;
+    }
+
+    uint64_t linesIn() const { return lines_in_; }
+    uint64_t linesOut() const { return lines_out_; }
+    uint64_t bytesIn() const { return bytes_in_; }
+    uint64_t bytesOut() const { return bytes_out_; }
+    uint64_t arcs() const { return arcs_out_; }
+
+private:
+    struct Point {
+        double p[3];
+        std::string text;  // Source line, sent as-is if nothing merges with it
+        uint64_t line_number;
+        uint64_t offset;
+    };
+
+    struct Ready {
+        std::string text;
+        uint64_t line_number;
+        uint64_t offset;
+    };
+
+    enum Fit { FIT_LINE, FIT_ARC };
+
+    // Largest deviation allowed, in program units
+    double tolerance() const { return inches_ ? tolerance_ / 25.4 : tolerance_; }
+
+    // True if line is a feed move that can join a run; its target goes to target
+    bool coalescable(std::string_view text, double* target) const {
+        if (incremental_ || inverse_time_ || known_ != 7) return false;
+        std::string_view in = text.substr(0, text.size() - 1);
+        for (int axis = 0; axis < 3; ++axis) target[axis] = position_[axis];
+        bool moves = false;
+        bool g1 = (motion_ == 10);
+        GcodeWord word;
+        size_t pos = 0;
+        while (parseGcodeWord(in, pos, word)) {
+            switch (word.letter) {
+                case 'G':
+                    if (gcodeCode(word) != 10) return false;
+                    g1 = true;
+                    break;
+                case 'F':
+                    if (word.value != feed_) return false;
+                    break;
+                case 'X': case 'Y': case 'Z':
+                    target[word.letter - 'X'] = word.value;
+                    moves = true;
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return pos == in.size() && moves && g1;
+    }
+
+    // Follow the modal state and position through a line that is passed on.
+    // Returns true if the line sets the motion mode itself.
+    bool track(std::string_view text) {
+        GcodeWord word;
+        size_t pos = 0;
+        bool axis_moves = true;  // Axis words are a position, not G10/G28/G92 data
+        bool sets_motion = false;
+        double values[3];
+        int given = 0;
+        while (parseGcodeWord(text, pos, word)) {
+            int code = gcodeCode(word);
+            switch (word.letter) {
+                case 'G':
+                    if (code <= 30 || (code >= 382 && code <= 385) || code == 800) {
+                        motion_ = code;
+                        sets_motion = true;
+                    } else if (code >= 170 && code <= 190) plane_ = code;
+                    else if (code == 200 || code == 210) {
+                        // Positions known so far are in the other unit
+                        if (inches_ != (code == 200)) known_ = 0;
+                        inches_ = (code == 200);
+                    } else if (code == 900 || code == 910) incremental_ = (code == 910);
+                    else if (code == 930 || code == 940) inverse_time_ = (code == 930);
+                    if (code == 100 || code == 280 || code == 300 || code == 530 || code == 920 ||
+                        (code >= 382 && code <= 385) || (code >= 540 && code <= 590)) {
+                        // The position in work coordinates is no longer known
+                        known_ = 0;
+                        axis_moves = false;
+                    }
+                    break;
+                case 'M':
+                    if (code == 20 || code == 300) {
+                        motion_ = 10;
+                        plane_ = 170;
+                        incremental_ = false;
+                        inverse_time_ = false;
+                    }
+                    break;
+                case 'F':
+                    feed_ = word.value;
+                    break;
+                case 'X': case 'Y': case 'Z':
+                    values[word.letter - 'X'] = word.value;
+                    given |= 1 << (word.letter - 'X');
+                    break;
+            }
+        }
+        if (!axis_moves) return sets_motion;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!(given & (1 << axis))) continue;
+            if (!incremental_) {
+                position_[axis] = values[axis];
+                known_ |= 1 << axis;
+            } else {
+                position_[axis] += values[axis];
+            }
+        }
+        return sets_motion;
+    }
+
+    // Add a point to the run, emitting the run first if the point does not fit
+    void extend(Point point) {
+        if (run_.size() == MAX_COALESCE_POINTS) flush();
+        if (run_.empty()) {
+            for (int axis = 0; axis < 3; ++axis) anchor_[axis] = position_[axis];
+        }
+        run_.push_back(std::move(point));
+        if (run_.size() == 1) {
+            fit_ = FIT_LINE;
+        } else if (fitsLine()) {
+            fit_ = FIT_LINE;
+        } else if (arcs_ && run_.size() >= 3 && fitsArc()) {
+            fit_ = FIT_ARC;
+        } else {
+            Point last = std::move(run_.back());
+            run_.pop_back();
+            flush();
+            extend(std::move(last));
+            return;
+        }
+        for (int axis = 0; axis < 3; ++axis) position_[axis] = run_.back().p[axis];
+    }
+
+    // Distance from q to the segment a-b, and where along it q lies (0..1)
+    static double segmentDistance(const double* a, const double* b, const double* q, double& t) {
+        double d[3], w[3];
+        double len2 = 0, dot = 0;
+        for (int i = 0; i < 3; ++i) {
+            d[i] = b[i] - a[i];
+            w[i] = q[i] - a[i];
+            len2 += d[i] * d[i];
+            dot += d[i] * w[i];
+        }
+        t = (len2 > 0) ? std::clamp(dot / len2, 0.0, 1.0) : 0;
+        double sum = 0;
+        for (int i = 0; i < 3; ++i) {
+            double e = w[i] - t * d[i];
+            sum += e * e;
+        }
+        return std::sqrt(sum);
+    }
+
+    // True if one G1 from the anchor to the last point covers the run. The
+    // points must also advance along it, so back-and-forth passes are kept.
+    bool fitsLine() const {
+        const double* end = run_.back().p;
+        double previous = 0;
+        for (size_t i = 0; i + 1 < run_.size(); ++i) {
+            double t;
+            if (segmentDistance(anchor_, end, run_[i].p, t) > tolerance() || t < previous) return false;
+            previous = t;
+        }
+        return true;
+    }
+
+    // True if one arc from the anchor through the middle point to the last
+    // point covers the run: every point lies on it, every original segment's
+    // sagitta is within tolerance and the points turn one way, less than a
+    // full circle. The fitted centre goes to center_ and the turn to ccw_.
+    bool fitsArc() {
+        const double* a = anchor_;
+        const double* m = run_[(run_.size() - 1) / 2].p;
+        const double* e = run_.back().p;
+        if (plane_ != 170) return false;
+        for (const Point& point : run_) {
+            if (std::fabs(point.p[2] - a[2]) > 1e-9) return false;  // Planar arcs only
+        }
+
+        // Circle through three points
+        double bx = m[0] - a[0], by = m[1] - a[1];
+        double cx = e[0] - a[0], cy = e[1] - a[1];
+        double det = 2 * (bx * cy - by * cx);
+        double scale = bx * bx + by * by + cx * cx + cy * cy;
+        if (std::fabs(det) < 1e-12 * scale) return false;  // Collinear
+        double b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+        double ux = (cy * b2 - by * c2) / det, uy = (bx * c2 - cx * b2) / det;
+        double center[2] = {a[0] + ux, a[1] + uy};
+        double radius = std::sqrt(ux * ux + uy * uy);
+
+        double tol = tolerance();
+        double swept = 0;
+        int turn = 0;
+        const double* from = a;
+        for (const Point& point : run_) {
+            const double* to = point.p;
+            double dx = to[0] - center[0], dy = to[1] - center[1];
+            if (std::fabs(std::sqrt(dx * dx + dy * dy) - radius) > tol) return false;
+            double fx = from[0] - center[0], fy = from[1] - center[1];
+            double cross = fx * dy - fy * dx;
+            double angle = std::atan2(cross, fx * dx + fy * dy);
+            int sign = (angle > 0) ? 1 : -1;
+            if (turn != 0 && sign != turn) return false;
+            turn = sign;
+            swept += std::fabs(angle);
+            double chord2 = (to[0] - from[0]) * (to[0] - from[0]) + (to[1] - from[1]) * (to[1] - from[1]);
+            if (radius - std::sqrt(std::max(0.0, radius * radius - chord2 / 4)) > tol) return false;
+            from = to;
+        }
+        if (swept > 1.9 * M_PI) return false;
+        center_[0] = center[0];
+        center_[1] = center[1];
+        ccw_ = (turn > 0);
+        return true;
+    }
+
+    // Emit the run held so far as one line, one arc, or its single source line
+    void flush() {
+        if (run_.empty()) return;
+        const Point& last = run_.back();
+        char text[MAX_LINE_LENGTH];
+        int precision = COALESCE_PRECISION + (inches_ ? 1 : 0);
+        if (run_.size() == 1) {
+            emitSource(last.text, last.line_number, last.offset, lineIsExplicitG1(last.text));
+        } else if (fit_ == FIT_LINE) {
+            int n = snprintf(text, sizeof(text), "G1");
+            for (int axis = 0; axis < 3; ++axis) {
+                if (last.p[axis] != anchor_[axis]) {
+                    n += appendNumber(text + n, sizeof(text) - n, static_cast<char>('X' + axis), last.p[axis], precision);
+                }
+            }
+            text[n++] = '\n';
+            emit(std::string_view(text, n), last.line_number, last.offset);
+            arc_modal_ = false;
+        } else {
+            int n = snprintf(text, sizeof(text), "%s", ccw_ ? "G3" : "G2");
+            n += appendNumber(text + n, sizeof(text) - n, 'X', last.p[0], precision);
+            n += appendNumber(text + n, sizeof(text) - n, 'Y', last.p[1], precision);
+            n += appendNumber(text + n, sizeof(text) - n, 'I', center_[0] - anchor_[0], precision);
+            n += appendNumber(text + n, sizeof(text) - n, 'J', center_[1] - anchor_[1], precision);
+            text[n++] = '\n';
+            emit(std::string_view(text, n), last.line_number, last.offset);
+            ++arcs_out_;
+            arc_modal_ = true;
+        }
+        run_.clear();
+    }
+
+    static bool lineIsExplicitG1(std::string_view text) {
+        GcodeWord word;
+        size_t pos = 0;
+        while (parseGcodeWord(text, pos, word)) {
+            if (word.letter == 'G' && gcodeCode(word) == 10) return true;
+        }
+        return false;
+    }
+
+    // Emit a source line unchanged. After an arc the controller is in G2/G3
+    // while the program expects G1, so G1 is restored first unless the line
+    // sets the motion mode itself.
+    void emitSource(std::string_view text, uint64_t line_number, uint64_t offset, bool sets_motion) {
+        if (arc_modal_ && !sets_motion) emit("G1\n", last_line_number_, last_offset_);
+        arc_modal_ = false;
+        emit(text, line_number, offset);
+    }
+
+    static int appendNumber(char* out, size_t cap, char letter, double value, int precision) {
+        int n = snprintf(out, cap, "%c%.*f", letter, precision, value);
+        // Trim trailing zeros and a bare decimal point
+        while (n > 2 && out[n - 1] == '0') --n;
+        if (out[n - 1] == '.') --n;
+        if (n == 3 && out[1] == '-' && out[2] == '0') {
+            out[1] = '0';
+            n = 2;
+        }
+        return n;
+    }
+
+    void emit(std::string_view text, uint64_t line_number, uint64_t offset) {
+        ready_.push_back({std::string(text), line_number, offset});
+        last_line_number_ = line_number;
+        last_offset_ = offset;
+        lines_out_ += 1;
+        bytes_out_ += text.size();
+    }
+
+    double tolerance_;
+    bool arcs_;
+    std::vector<Point> run_;
+    Fit fit_ = FIT_LINE;
+    double anchor_[3] = {0, 0, 0};  // Where the run starts
+    double center_[2] = {0, 0};     // Last arc fit
+    bool ccw_ = false;
+    bool arc_modal_ = false;        // The last line sent was an arc
+    uint64_t last_line_number_ = 0;
+    uint64_t last_offset_ = 0;
+    std::vector<Ready> ready_;
+    size_t ready_pos_ = 0;
+
+    // State of the program as sent so far
+    double position_[3] = {0, 0, 0};
+    int known_ = 0;                 // Bit per axis whose position is known
+    int16_t motion_ = 0;
+    int16_t plane_ = 170;
+    bool inches_ = false;
+    bool incremental_ = false;
+    bool inverse_time_ = false;
+    double feed_ = -1;
+
+    uint64_t lines_in_ = 0;
+    uint64_t lines_out_ = 0;
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+    uint64_t arcs_out_ = 0;
+};
+
+// Modal state that has to be restored before streaming from the middle of a
+// job: the G-code modal groups GRBL keeps, plus feed, spindle and coolant.
+// G codes are stored as ten times their number (G38.2 -> 382).
+struct ModalState {
+    int16_t motion = 0;      // G0, G1, G2, G3, G38.x, G80
+    int16_t plane = 170;     // G17, G18, G19
+    int16_t units = 210;     // G20, G21
+    int16_t distance = 900;  // G90, G91
+    int16_t feed_mode = 940; // G93, G94
+    int16_t wcs = 540;       // G54 - G59
+    int8_t spindle = 5;      // M3, M4, M5
+    uint8_t coolant = 0;     // Bit 0 mist (M7), bit 1 flood (M8)
+    double feed = 0;
+    double speed = 0;
+
+    // Update the state from one cleaned line
+    void apply(std::string_view line) {
+        GcodeWord word;
+        size_t pos = 0;
+        while (parseGcodeWord(line, pos, word)) {
+            int code = gcodeCode(word);
+            switch (word.letter) {
+                case 'G':
+                    if (isMotion(code)) motion = code;
+                    else if (code >= 170 && code <= 190) plane = code;
+                    else if (code == 200 || code == 210) units = code;
+                    else if (code == 900 || code == 910) distance = code;
+                    else if (code == 930 || code == 940) feed_mode = code;
+                    else if (code >= 540 && code <= 590 && code % 10 == 0) wcs = code;
+                    break;
+                case 'M':
+                    if (code == 30 || code == 40 || code == 50) spindle = code / 10;
+                    else if (code == 70) coolant |= 1;
+                    else if (code == 80) coolant |= 2;
+                    else if (code == 90) coolant = 0;
+                    else if (code == 20 || code == 300) programEnd();
+                    break;
+                case 'F':
+                    feed = word.value;
+                    break;
+                case 'S':
+                    speed = word.value;
+                    break;
+            }
+        }
+    }
+
+    // M2/M30 reset the modal groups as GRBL does
+    void programEnd() {
+        motion = 10;
+        plane = 170;
+        distance = 900;
+        feed_mode = 940;
+        wcs = 540;
+        spindle = 5;
+        coolant = 0;
+    }
+
+    // G0, G1, G2, G3, G38.2-G38.5 and G80
+    static bool isMotion(int code) {
+        return code <= 30 || (code >= 382 && code <= 385) || code == 800;
+    }
+
+    static std::string g(int code) {
+        std::string word = "G" + std::to_string(code / 10);
+        if (code % 10 != 0) word += "." + std::to_string(code % 10);
+        return word;
+    }
+
+    // G-code lines that put a controller into this state, in send order. The
+    // motion mode is not among them: GRBL rejects a G2/G3 without axis words
+    // and a G1 without F under G93, so it goes in front of the first line
+    // that moves instead (see motionWord()).
+    std::vector<std::string> preamble() const {
+        char number[32];
+        std::vector<std::string> lines;
+        lines.push_back(g(units) + " " + g(distance) + " " + g(plane) + " " + g(feed_mode) + " " + g(wcs));
+        if (feed > 0 && feed_mode == 940) {
+            snprintf(number, sizeof(number), "F%.10g", feed);
+            lines.push_back(number);
+        }
+        snprintf(number, sizeof(number), "S%.10g", speed);
+        lines.push_back(std::string(number) + " M" + std::to_string(spindle));
+        if (coolant == 0) lines.push_back("M9");
+        if (coolant & 1) lines.push_back("M7");
+        if (coolant & 2) lines.push_back("M8");
+        return lines;
+    }
+
+    // Motion mode word to restore, or "" for none (never re-arm a probe cycle)
+    std::string motionWord() const { return motion <= 30 ? g(motion) : ""; }
+};
+
+// Size of the slices a file is split into for parallel validation
+const size_t VALIDATE_CHUNK_SIZE = 1 << 20;
+
+// Most problems listed in a validation report (all of them are counted)
+const size_t MAX_REPORTED_ISSUES = 20;
+
+// Default G0 rate for the run-time estimate, in mm/min
+const double DEFAULT_RAPID_RATE = 1000;
+
+// GRBL's default arc tolerance ($12), which sets how many segments an arc is
+// cut into, in mm
+const double GRBL_ARC_TOLERANCE = 0.002;
+
+// A line the streamer would stop at, or GRBL would answer with error:
+struct ValidationIssue {
+    uint64_t line_number;
+    std::string what;
+};
+
+// Function to check whether GRBL 1.1 accepts a word. Returns nullptr if it
+// does, or what is wrong with it.
+const char* unsupportedWord(const GcodeWord& word) {
+    int code = gcodeCode(word);
+    switch (word.letter) {
+        case 'G':
+            switch (code) {
+                case 0: case 10: case 20: case 30: case 40: case 100: case 170: case 180: case 190:
+                case 200: case 210: case 280: case 281: case 300: case 301: case 382: case 383:
+                case 384: case 385: case 400: case 431: case 490: case 530: case 540: case 550:
+                case 560: case 570: case 580: case 590: case 610: case 800: case 900: case 910:
+                case 911: case 920: case 921: case 930: case 940:
+                    return nullptr;
+            }
+            return "unsupported G code";
+        case 'M':
+            switch (code) {
+                case 0: case 10: case 20: case 30: case 40: case 50: case 70: case 80: case 90:
+                case 300: case 560:
+                    return nullptr;
+            }
+            return "unsupported M code";
+        case 'F': case 'I': case 'J': case 'K': case 'L': case 'N': case 'P': case 'R': case 'S':
+        case 'T': case 'X': case 'Y': case 'Z':
+            return nullptr;
+    }
+    return "unsupported word";
+}
+
+// A word that matters for the run-time estimate; letter 0 ends a line
+struct MotionWord {
+    char letter;
+    double value;
+};
+
+// Most motion words a line can hold
+const size_t MAX_MOTION_WORDS = MAX_LINE_LENGTH / 2;
+
+// Function to collect the words of a cleaned line (with its '\n') that
+// matter to the estimate. Returns their count.
+size_t motionWords(std::string_view text, MotionWord* words) {
+    text = text.substr(0, text.size() - 1);
+    if (text.empty() || text.front() == '$') return 0;  // GRBL system command
+    size_t count = 0;
+    GcodeWord word;
+    size_t pos = 0;
+    while (count < MAX_MOTION_WORDS && parseGcodeWord(text, pos, word)) {
+        switch (word.letter) {
+            case 'N': case 'S': case 'T': case 'L':
+                break;
+            default:
+                words[count++] = {word.letter, word.value};
+        }
+    }
+    return count;
+}
+
+// Function to format seconds as h:mm:ss
+std::string formatDuration(double seconds) {
+    long total = static_cast<long>(seconds + 0.5);
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    return duration;
+}
+
+// Run-time estimate from feeds and distances, fed one line at a time.
+// Acceleration is not modelled, so short segments come out optimistic.
+// It also counts the planner blocks GRBL makes of each move: one per line,
+// one per segment for arcs. Work offsets are not known, so a G53 move is
+// taken to end at its machine coordinates in the same frame.
+class TimeEstimator {
+public:
+    explicit TimeEstimator(double rapid_rate) : rapid_rate_(rapid_rate) {}
+
+    // Account for one line's words. Returns the planner blocks it makes.
+    uint32_t line(const MotionWord* words, size_t count) {
+        double target[3] = {position_[0], position_[1], position_[2]};
+        double values[3];
+        int given = 0;
+        double offset[3] = {0, 0, 0};
+        double radius = 0;
+        double dwell = 0;
+        bool moves = true;     // Axis words are a move, not G10/G92/G28 data
+        bool machine = false;  // G53: absolute machine coordinates for this line
+        bool has_radius = false;
+        for (size_t i = 0; i < count; ++i) {
+            const MotionWord& word = words[i];
+            int code = static_cast<int>(word.value * 10 + 0.5);
+            switch (word.letter) {
+                case 'G':
+                    if (code <= 30) motion_ = code;
+                    else if (code >= 170 && code <= 190) plane_ = code;
+                    else if (code == 200) scale_ = 25.4;
+                    else if (code == 210) scale_ = 1;
+                    else if (code == 900 || code == 910) incremental_ = (code == 910);
+                    else if (code == 930 || code == 940) inverse_time_ = (code == 930);
+                    else if (code == 40) dwell = -1;  // Duration follows in P
+                    else if (code == 530) machine = true;
+                    else if (code == 100 || code == 280 || code == 300 || code == 920 ||
+                             (code >= 382 && code <= 385)) moves = false;
+                    break;
+                case 'M':
+                    if (code == 20 || code == 300) {
+                        motion_ = 10;
+                        plane_ = 170;
+                        incremental_ = false;
+                        inverse_time_ = false;
+                    }
+                    break;
+                case 'F':
+                    feed_ = word.value * scale_;
+                    break;
+                case 'P':
+                    if (dwell < 0) dwell = word.value;
+                    break;
+                case 'R':
+                    radius = word.value * scale_;
+                    has_radius = true;
+                    break;
+                case 'X': case 'Y': case 'Z':
+                    values[word.letter - 'X'] = word.value;
+                    given |= 1 << (word.letter - 'X');
+                    break;
+                case 'I': case 'J': case 'K':
+                    offset[word.letter - 'I'] = word.value * scale_;
+                    break;
+            }
+        }
+        if (dwell > 0) minutes_ += dwell / 60;
+        if (given == 0 || !moves) return 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!(given & (1 << axis))) continue;
+            double value = values[axis] * scale_;
+            target[axis] = (incremental_ && !machine) ? position_[axis] + value : value;  // G53 ignores G91
+        }
+
+        // G53 moves straight at G0 or G1 (GRBL refuses it with anything else)
+        int motion = (machine && motion_ != 10) ? 0 : motion_;
+        uint32_t blocks = 1;
+        double length = (motion == 20 || motion == 30) ? arcLength(target, offset, radius, has_radius, blocks)
+                                                       : distance(position_, target);
+        if (length == 0) blocks = 0;  // Moves without steps never reach the planner
+        if (motion == 0) {
+            rapid_distance_ += length;
+            minutes_ += length / rapid_rate_;
+        } else if (motion <= 30) {
+            feed_distance_ += length;
+            if (inverse_time_) {
+                if (feed_ > 0) minutes_ += 1 / (feed_ / scale_);  // F is moves per minute
+            } else if (feed_ > 0) {
+                minutes_ += length / feed_;
+            }
+        }
+        for (int axis = 0; axis < 3; ++axis) position_[axis] = target[axis];
+        return blocks;
+    }
+
+    double minutes() const { return minutes_; }
+    double feedDistance() const { return feed_distance_; }
+    double rapidDistance() const { return rapid_distance_; }
+
+private:
+    static double distance(const double* a, const double* b) {
+        double dx = b[0] - a[0], dy = b[1] - a[1], dz = b[2] - a[2];
+        return std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+
+    // Length of a helix in the current plane, from I/J/K centre offsets or R,
+    // and the segments GRBL cuts it into
+    double arcLength(const double* target, const double* offset, double radius, bool has_radius,
+                     uint32_t& segments) const {
+        int a = (plane_ == 190) ? 1 : 0;  // First and second plane axis, then the linear one
+        int b = (plane_ == 170) ? 1 : 2;
+        int linear = 3 - a - b;
+        double ex = target[a] - position_[a], ey = target[b] - position_[b];
+        double angle;
+        double r;
+        if (has_radius) {
+            double chord = std::sqrt(ex * ex + ey * ey);
+            r = std::fabs(radius);
+            if (r == 0 || chord > 2 * r) return distance(position_, target);
+            angle = 2 * std::asin(chord / (2 * r));
+            if (radius < 0) angle = 2 * M_PI - angle;  // Negative R takes the long way round
+        } else {
+            double sx = -offset[a], sy = -offset[b];    // Start relative to the centre
+            double tx = ex - offset[a], ty = ey - offset[b];
+            r = std::sqrt(sx * sx + sy * sy);
+            angle = std::atan2(sx * ty - sy * tx, sx * tx + sy * ty);  // Counter-clockwise
+            if (motion_ == 20) angle = -angle;
+            if (angle <= 1e-9) angle += 2 * M_PI;  // Same start and end is a full circle
+        }
+        double along = r * angle;
+        double rise = target[linear] - position_[linear];
+        if (r > GRBL_ARC_TOLERANCE) {
+            double step = std::sqrt(GRBL_ARC_TOLERANCE * (2 * r - GRBL_ARC_TOLERANCE));
+            segments = std::max<uint32_t>(1, static_cast<uint32_t>(0.5 * along / step));
+        }
+        return std::sqrt(along * along + rise * rise);
+    }
+
+    double rapid_rate_;
+    double position_[3] = {0, 0, 0};  // mm
+    double feed_ = 0;                 // mm/min
+    double scale_ = 1;                // mm per program unit
+    int16_t motion_ = 0;
+    int16_t plane_ = 170;
+    bool incremental_ = false;
+    bool inverse_time_ = false;
+    double minutes_ = 0;
+    double feed_distance_ = 0;
+    double rapid_distance_ = 0;
+};
+
+// What one validation scan found in a part of the file
+struct ChunkScan {
+    uint64_t source_lines = 0;  // Lines in the part, including blank ones
+    uint64_t lines = 0;         // Lines that would be sent
+    uint64_t bytes = 0;         // Bytes sent for them, after cleanup
+    size_t longest = 0;
+    uint64_t issue_count = 0;
+    std::vector<ValidationIssue> issues;  // Line numbers relative to the part
+    std::vector<MotionWord> words;        // Input for the estimate
+};
+
+// Function to validate every line ingest produces, exactly as it would be sent
+void scanGcode(GcodeIngest& ingest, int rx_size, ChunkScan& scan) {
+    auto issue = [&scan](uint64_t line_number, std::string what) {
+        if (scan.issue_count++ < MAX_REPORTED_ISSUES) scan.issues.push_back({line_number, std::move(what)});
+    };
+    GcodeLine line;
+    while (ingest.next(line)) {
+        ++scan.lines;
+        scan.bytes += line.text.size();
+        scan.longest = std::max(scan.longest, line.text.size());
+        if (line.text.size() > static_cast<size_t>(rx_size)) {
+            issue(line.line_number, "longer than the " + std::to_string(rx_size) + " byte RX buffer");
+        }
+
+        std::string_view text = line.text.substr(0, line.text.size() - 1);
+        if (text.front() == '$') continue;  // GRBL system command
+        GcodeWord word;
+        size_t pos = 0;
+        size_t first = scan.words.size();
+        while (parseGcodeWord(text, pos, word)) {
+            if (const char* problem = unsupportedWord(word)) {
+                issue(line.line_number, std::string(problem) + " " + word.letter + std::string(word.num, word.len));
+            }
+            switch (word.letter) {
+                case 'N': case 'S': case 'T': case 'L':
+                    break;
+                default:
+                    scan.words.push_back({word.letter, word.value});
+            }
+        }
+        if (pos < text.size()) issue(line.line_number, "cannot parse \"" + std::string(text.substr(pos)) + "\"");
+        if (scan.words.size() > first) scan.words.push_back({0, 0});
+    }
+    if (ingest.error() != nullptr) {
+        issue(ingest.lineNumber(), ingest.error());
+    }
+}
+
+// Result of validating a whole file
+struct ValidationReport {
+    uint64_t lines = 0;
+    uint64_t bytes = 0;
+    size_t longest = 0;
+    uint64_t issue_count = 0;
+    std::vector<ValidationIssue> issues;  // The first ones, in file order
+    double minutes = 0;
+    double feed_distance = 0;
+    double rapid_distance = 0;
+    unsigned threads = 1;
+    double seconds = 0;
+
+    void print(std::ostream& out, const char* path) const {
+        out << "Validated " << path << ": " << lines << " lines, " << bytes << " bytes to send (longest line "
+            << longest << " bytes) in " << seconds << " s on " << threads << " thread" << (threads == 1 ? "" : "s")
+            << "\n";
+        out << "Estimated run time " << formatDuration(minutes * 60) << " (feed " << feed_distance << " mm, rapid " << rapid_distance
+            << " mm, acceleration not included)\n";
+        if (issue_count == 0) {
+            out << "No problems found.\n";
+            return;
+        }
+        out << issue_count << " problem" << (issue_count == 1 ? "" : "s") << " found:\n";
+        for (const ValidationIssue& issue : issues) {
+            out << "  ";
+            if (issue.line_number > 0) out << "line " << issue.line_number << ": ";
+            out << issue.what << "\n";
+        }
+        if (issue_count > issues.size()) out << "  ...\n";
+    }
+};
+
+// Function to validate a G-code file before streaming it. A mapped file is
+// cut at line boundaries into slices that are scanned on all cores; their
+// motion words are then run through the estimator in file order, a round of
+// slices at a time. Returns false if the file cannot be read.
+bool validateGcode(const char* path, int rx_size, double rapid_rate, unsigned clean_flags,
+                   ValidationReport& report) {
+    auto started = std::chrono::steady_clock::now();
+    GcodeIngest source;
+    if (!source.open(path)) return false;
+    source.setCleaning(clean_flags);
+    TimeEstimator estimator(rapid_rate);
+    uint64_t lines_before = 0;
+
+    // Fold one scanned part into the report
+    auto merge = [&](ChunkScan& scan) {
+        report.lines += scan.lines;
+        report.bytes += scan.bytes;
+        report.longest = std::max(report.longest, scan.longest);
+        report.issue_count += scan.issue_count;
+        for (ValidationIssue& issue : scan.issues) {
+            if (report.issues.size() == MAX_REPORTED_ISSUES) break;
+            report.issues.push_back({issue.line_number + lines_before, std::move(issue.what)});
+        }
+        size_t start = 0;
+        for (size_t i = 0; i < scan.words.size(); ++i) {
+            if (scan.words[i].letter != 0) continue;
+            estimator.line(scan.words.data() + start, i - start);
+            start = i + 1;
+        }
+        lines_before += scan.source_lines;
+    };
+
+    std::string_view data = source.mapped();
+    if (data.empty()) {
+        // Streamed input can only be read once, in order
+        ChunkScan scan;
+        scanGcode(source, rx_size, scan);
+        merge(scan);
+    } else {
+        report.threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t pos = 0;
+        while (pos < data.size()) {
+            // Cut the next round of slices, each ending after a newline
+            std::vector<std::string_view> slices;
+            std::vector<size_t> offsets;
+            while (pos < data.size() && slices.size() < report.threads) {
+                size_t end = std::min(pos + VALIDATE_CHUNK_SIZE, data.size());
+                const char* nl = static_cast<const char*>(memchr(data.data() + end - 1, '\n', data.size() - end + 1));
+                end = (nl != nullptr) ? static_cast<size_t>(nl - data.data()) + 1 : data.size();
+                slices.push_back(data.substr(pos, end - pos));
+                offsets.push_back(pos);
+                pos = end;
+            }
+
+            std::vector<ChunkScan> scans(slices.size());
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < slices.size(); ++i) {
+                workers.emplace_back([&, i] {
+                    GcodeIngest ingest;
+                    ingest.attach(slices[i], offsets[i]);
+                    ingest.setCleaning(clean_flags);
+                    scanGcode(ingest, rx_size, scans[i]);
+                    std::string_view slice = slices[i];
+                    scans[i].source_lines = std::count(slice.begin(), slice.end(), '\n') +
+                                            (slice.back() != '\n' ? 1 : 0);
+                });
+            }
+            for (std::thread& worker : workers) worker.join();
+            for (ChunkScan& scan : scans) merge(scan);
+        }
+    }
+
+    report.minutes = estimator.minutes();
+    report.feed_distance = estimator.feedDistance();
+    report.rapid_distance = estimator.rapidDistance();
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return true;
+}
+
+// Binary index of a G-code file, cached as <gcode>.idx. For every source line
+// it holds the line's file offset, the cleaned bytes sent up to and including
+// it and the estimated run time until its end, in three columns after a
+// fixed header. Seeking to a line and turning an acknowledged line into
+// progress and remaining time are plain array lookups on the mapping. The
+// cache is rebuilt when the file's size or mtime, the rapid rate of the
+// estimate or the cleaning flags no longer match.
+class LineIndex {
+public:
+    LineIndex() = default;
+    LineIndex(const LineIndex&) = delete;
+    LineIndex& operator=(const LineIndex&) = delete;
+
+    ~LineIndex() {
+        if (map_ != nullptr) munmap(map_, map_size_);
+    }
+
+    // Use the index cached next to gcode_path, or build it from data, the
+    // mapped file, and try to cache it. Returns false if the file cannot be
+    // indexed.
+    bool open(const char* gcode_path, std::string_view data, double rapid_rate, unsigned clean_flags, bool verbose) {
+        struct stat st;
+        if (stat(gcode_path, &st) != 0) return false;
+        Header expected = {};
+        memcpy(expected.magic, INDEX_MAGIC, sizeof(expected.magic));
+        expected.file_size = st.st_size;
+        expected.file_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        expected.rapid_rate = rapid_rate;
+        expected.clean_flags = clean_flags;
+
+        std::string path = std::string(gcode_path) + ".idx";
+        if (load(path, expected)) {
+            if (verbose) std::cout << "Using line index " << path << std::endl;
+            return true;
+        }
+        auto started = std::chrono::steady_clock::now();
+        if (!build(data, rapid_rate, clean_flags)) return false;
+        expected.lines = lines_;
+        bool cached = save(path, expected);
+        if (verbose) {
+            std::cout << "Indexed " << lines_ << " lines in "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() << " s"
+                      << (cached ? ", cached in " + path : ", not cached") << std::endl;
+        }
+        return true;
+    }
+
+    // Number of source lines
+    uint64_t lines() const { return lines_; }
+
+    // File offset of a 1-based source line
+    uint64_t offset(uint64_t line_number) const { return offsets_[line_number - 1]; }
+
+    // Cleaned bytes and estimated seconds of the lines up to and including
+    // line_number (0 for none)
+    uint64_t bytesThrough(uint64_t line_number) const { return line_number > 0 ? bytes_[line_number - 1] : 0; }
+    double secondsThrough(uint64_t line_number) const {
+        return line_number > 0 ? ms_[line_number - 1] / 1000.0 : 0;
+    }
+
+    // Description of what stopped the build, or nullptr
+    const char* error() const { return error_; }
+
+private:
+    static constexpr char INDEX_MAGIC[8] = {'G', 'S', 'I', 'N', 'D', 'E', 'X', '2'};
+
+    struct Header {
+        char magic[8];
+        uint64_t file_size;
+        int64_t file_mtime;
+        uint64_t lines;
+        double rapid_rate;
+        uint64_t clean_flags;  // CleanFlags the bytes column was counted with
+        uint64_t reserved[2];
+    };
+    static_assert(sizeof(Header) == 64, "index header layout");
+
+    // Bytes of the header and columns for a number of lines
+    static size_t fileSize(uint64_t lines) {
+        return sizeof(Header) + lines * (2 * sizeof(uint64_t) + sizeof(uint32_t));
+    }
+
+    bool load(const std::string& path, const Header& expected) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+        struct stat st;
+        Header header;
+        bool valid = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+                     header.file_size == expected.file_size && header.file_mtime == expected.file_mtime &&
+                     header.rapid_rate == expected.rapid_rate && header.clean_flags == expected.clean_flags &&
+                     static_cast<uint64_t>(st.st_size) == fileSize(header.lines);
+        void* map = valid ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        map_ = map;
+        map_size_ = st.st_size;
+        lines_ = header.lines;
+        const char* columns = static_cast<const char*>(map) + sizeof(Header);
+        offsets_ = reinterpret_cast<const uint64_t*>(columns);
+        bytes_ = offsets_ + lines_;
+        ms_ = reinterpret_cast<const uint32_t*>(bytes_ + lines_);
+        return true;
+    }
+
+    // One pass over the file, cleaning and estimating every line as a job
+    // would. Blank and comment lines the ingest skips start where the line
+    // before them ends.
+    bool build(std::string_view data, double rapid_rate, unsigned clean_flags) {
+        GcodeIngest ingest;
+        ingest.attach(data, 0);
+        ingest.setCleaning(clean_flags);
+        TimeEstimator estimator(rapid_rate);
+        uint64_t bytes = 0;
+        uint32_t ms = 0;
+        size_t pos = 0;  // Start of the next source line to index
+        auto add = [&](uint64_t offset) {
+            built_offsets_.push_back(offset);
+            built_bytes_.push_back(bytes);
+            built_ms_.push_back(ms);
+            const char* nl = static_cast<const char*>(memchr(data.data() + offset, '\n', data.size() - offset));
+            pos = (nl != nullptr) ? nl - data.data() + 1 : data.size();
+        };
+        GcodeLine line;
+        while (ingest.next(line)) {
+            while (built_offsets_.size() + 1 < line.line_number) add(pos);
+            MotionWord words[MAX_MOTION_WORDS];
+            estimator.line(words, motionWords(line.text, words));
+            bytes += line.text.size();
+            ms = static_cast<uint32_t>(std::min(estimator.minutes() * 60000, static_cast<double>(UINT32_MAX)));
+            add(line.offset);
+        }
+        if (ingest.error() != nullptr) {
+            error_ = ingest.error();
+            return false;
+        }
+        while (pos < data.size()) add(pos);
+
+        lines_ = built_offsets_.size();
+        offsets_ = built_offsets_.data();
+        bytes_ = built_bytes_.data();
+        ms_ = built_ms_.data();
+        return true;
+    }
+
+    // Write the index next to the job. Returns false if it cannot be cached.
+    bool save(const std::string& path, const Header& header) const {
+        std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (f == nullptr) return false;
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                       fwrite(offsets_, sizeof(uint64_t), lines_, f) == lines_ &&
+                       fwrite(bytes_, sizeof(uint64_t), lines_, f) == lines_ &&
+                       fwrite(ms_, sizeof(uint32_t), lines_, f) == lines_;
+        if (fclose(f) != 0 || !written || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    uint64_t lines_ = 0;
+    const uint64_t* offsets_ = nullptr;
+    const uint64_t* bytes_ = nullptr;
+    const uint32_t* ms_ = nullptr;
+    std::vector<uint64_t> built_offsets_;  // Columns of a freshly built index
+    std::vector<uint64_t> built_bytes_;
+    std::vector<uint32_t> built_ms_;
+    const char* error_ = nullptr;
+};
+
+// Options for the parser stage
+struct PipelineConfig {
+    SegmentCoalescer* coalescer = nullptr;  // Merge segments and fit arcs first
+    GcodeCompactor* compactor = nullptr;  // Compact lines before queueing them
+    bool track_modal = false;             // Record the modal state after every line
+    TimeEstimator* block_counter = nullptr;  // Count the planner blocks of every line
+    ModalState modal;                     // Modal state at the first line
+    std::vector<std::string> preamble;    // Lines queued before the file's lines
+    std::string motion;                   // Motion mode to put in front of the first move
+};
+
+// Number of prepared lines the parser thread may run ahead of the sender
+const size_t LINE_QUEUE_CAPACITY = 1024;
+
+// Lock-free single-producer/single-consumer ring. Capacity must be a power of
+// two. The producer fills slots in place (producerSlot() then commit()) and
+// the consumer reads them in place (front() then pop()), so nothing is copied
+// through the queue itself.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // Producer: next free slot, or nullptr if the queue is full
+    T* producerSlot() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == Capacity) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == Capacity) return nullptr;
+        }
+        return &slots_[tail & (Capacity - 1)];
+    }
+
+    // Producer: publish the slot returned by producerSlot()
+    void commit() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst); }
+
+    // Consumer: oldest published slot, or nullptr if the queue is empty
+    T* front() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_seq_cst);
+            if (head == tail_cache_) return nullptr;
+        }
+        return &slots_[head & (Capacity - 1)];
+    }
+
+    // Consumer: the published slot n places behind front(), or nullptr
+    T* peek(size_t n) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (tail_cache_ - head <= n) {
+            tail_cache_ = tail_.load(std::memory_order_seq_cst);
+            if (tail_cache_ - head <= n) return nullptr;
+        }
+        return &slots_[(head + n) & (Capacity - 1)];
+    }
+
+    // Consumer: release the slot returned by front()
+    void pop() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst); }
+
+    bool empty() const {
+        return head_.load(std::memory_order_seq_cst) == tail_.load(std::memory_order_seq_cst);
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;  // Consumer's last view of tail_
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;  // Producer's last view of head_
+    alignas(64) T slots_[Capacity];
+};
+
+// A cleaned (and possibly compacted) line waiting in the send queue
+struct PreparedLine {
+    uint64_t line_number;  // 1-based line number in the source file (0 for preamble lines)
+    uint64_t offset;       // Byte offset of the source line in the file
+    ModalState modal;      // Modal state after this line (if tracked)
+    uint16_t len;          // Length of text including the trailing '\n'
+    uint16_t blocks;       // Planner blocks GRBL makes of it (if counted)
+    char text[MAX_LINE_LENGTH];
+};
+
+// Parser stage of the streaming pipeline. A background thread reads and
+// prepares lines into an SPSC queue; the I/O thread consumes them in place.
+// Each side sleeps only when the queue is empty/full and is woken through an
+// eventfd, so the I/O thread can wait on the queue together with the port.
+class LinePipeline {
+public:
+    LinePipeline() {
+        consumer_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        producer_event_ = eventfd(0, EFD_CLOEXEC);
+    }
+    LinePipeline(const LinePipeline&) = delete;
+    LinePipeline& operator=(const LinePipeline&) = delete;
+
+    ~LinePipeline() {
+        stop();
+        close(consumer_event_);
+        close(producer_event_);
+    }
+
+    // Start the parser thread. ingest and the config's compactor belong to
+    // the thread until finished() returns true or stop() has been called.
+    void start(GcodeIngest& ingest, const PipelineConfig& config) {
+        config_ = config;
+        ingest_ = &ingest;
+        thread_ = std::thread([this, &ingest] { produce(ingest); });
+    }
+
+    // True once start() has been called
+    bool started() const { return thread_.joinable(); }
+
+    // Stop the parser thread (if still running) and wait for it
+    void stop() {
+        stopping_.store(true);
+        notify(producer_event_);
+        if (thread_.joinable()) {
+            if (!done()) ingest_->cancel();  // It may be waiting for streamed input
+            thread_.join();
+        }
+    }
+
+    // Consumer: next prepared line, or nullptr if none is ready yet. When it
+    // returns nullptr, eventFd() becomes readable once a line is added or the
+    // parser finishes.
+    PreparedLine* front() {
+        PreparedLine* line = queue_.front();
+        if (line != nullptr) return line;
+        consumer_waiting_.store(true);
+        line = queue_.front();
+        if (line != nullptr || done_.load()) consumer_waiting_.store(false);
+        return line;
+    }
+
+    // Consumer: line n places behind front() if it is already queued,
+    // without arming eventFd()
+    PreparedLine* peek(size_t n) { return queue_.peek(n); }
+
+    // Consumer: release the line returned by front()
+    void pop() {
+        queue_.pop();
+        if (producer_waiting_.load() && producer_waiting_.exchange(false)) notify(producer_event_);
+    }
+
+    // True once the parser has ended (the queue may still hold lines)
+    bool done() const { return done_.load(std::memory_order_acquire); }
+
+    // True once every line has been consumed
+    bool finished() const { return done() && queue_.empty(); }
+
+    // Ingest error, valid once done() is true
+    const char* error() const { return error_; }
+
+    // Readable when the consumer should look at the queue again
+    int eventFd() const { return consumer_event_; }
+
+    // Reset eventFd() after it polled readable
+    void clearEvent() {
+        uint64_t value;
+        while (read(consumer_event_, &value, sizeof(value)) > 0) {}
+    }
+
+private:
+    static void notify(int event) {
+        uint64_t one = 1;
+        while (write(event, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+
+    void wakeConsumer() {
+        if (consumer_waiting_.load() && consumer_waiting_.exchange(false)) notify(consumer_event_);
+    }
+
+    // Wait for a free queue slot. Returns nullptr if the pipeline is stopping.
+    PreparedLine* freeSlot() {
+        PreparedLine* slot = queue_.producerSlot();
+        while (slot == nullptr) {
+            producer_waiting_.store(true);
+            slot = queue_.producerSlot();
+            if (slot != nullptr) break;
+            uint64_t value;
+            if (read(producer_event_, &value, sizeof(value)) < 0 && errno != EINTR) return nullptr;
+            if (stopping_.load()) return nullptr;
+            slot = queue_.producerSlot();
+        }
+        return slot;
+    }
+
+    // Queue one line. Returns false if the pipeline is stopping.
+    bool enqueue(const GcodeLine& line, const ModalState& modal, uint16_t blocks = 0) {
+        PreparedLine* slot = freeSlot();
+        if (slot == nullptr) return false;
+        slot->line_number = line.line_number;
+        slot->offset = line.offset;
+        slot->modal = modal;
+        slot->len = static_cast<uint16_t>(line.text.size());
+        slot->blocks = blocks;
+        memcpy(slot->text, line.text.data(), line.text.size());
+        queue_.commit();
+        wakeConsumer();
+        return true;
+    }
+
+    // Track, compact and queue one line as it will be sent. Returns false if
+    // the pipeline is stopping.
+    bool send(GcodeLine& line, ModalState& modal) {
+        if (!pending_motion_.empty() && !restoreMotion(line)) {
+            error_ = "no room to restore the motion mode on the first move";
+            return false;
+        }
+        if (config_.track_modal) modal.apply(line.text);
+        uint16_t blocks = config_.block_counter != nullptr ? countBlocks(line.text) : 0;
+        if (config_.compactor != nullptr && !config_.compactor->apply(line)) return true;
+        return enqueue(line, modal, blocks);
+    }
+
+    // Put the restored motion mode in front of line if it is the first that
+    // moves. Lines without axis words, '$' commands and the non-modal commands
+    // that take axis words (G10, G28, G30, G92) leave it pending; a line with
+    // its own motion word drops it. Returns false if the line has no room.
+    bool restoreMotion(GcodeLine& line) {
+        std::string_view text = line.text.substr(0, line.text.size() - 1);
+        if (text.empty() || text.front() == '$') return true;
+        bool axes = false;
+        GcodeWord word;
+        size_t pos = 0;
+        while (parseGcodeWord(text, pos, word)) {
+            int code = gcodeCode(word);
+            if (word.letter == 'G' && ModalState::isMotion(code)) {
+                pending_motion_.clear();
+                return true;
+            }
+            if (word.letter == 'G' && (code == 100 || code == 280 || code == 300 || code == 920)) return true;
+            if (word.letter == 'X' || word.letter == 'Y' || word.letter == 'Z') axes = true;
+        }
+        if (!axes) return true;
+        if (pending_motion_.size() + line.text.size() > MAX_LINE_LENGTH) return false;
+        motion_line_ = pending_motion_ + std::string(line.text);
+        line.text = motion_line_;
+        pending_motion_.clear();
+        return true;
+    }
+
+    // Planner blocks the controller will make of a cleaned line
+    uint16_t countBlocks(std::string_view text) {
+        MotionWord words[MAX_MOTION_WORDS];
+        size_t count = motionWords(text, words);
+        uint32_t blocks = config_.block_counter->line(words, count);
+        return static_cast<uint16_t>(std::min<uint32_t>(blocks, UINT16_MAX));
+    }
+
+    void produce(GcodeIngest& ingest) {
+        ModalState modal = config_.modal;
+        pending_motion_ = config_.motion;
+        bool running = true;
+        for (const std::string& text : config_.preamble) {
+            std::string sent = text + "\n";
+            GcodeLine line = {sent, 0, 0};
+            if (!(running = enqueue(line, modal))) break;
+        }
+
+        GcodeLine line;
+        SegmentCoalescer* coalescer = config_.coalescer;
+        while (running && !stopping_.load(std::memory_order_relaxed) && ingest.next(line)) {
+            if (coalescer == nullptr) {
+                running = send(line, modal);
+                continue;
+            }
+            coalescer->push(line);
+            while (running && coalescer->pop(line)) running = send(line, modal);
+        }
+        if (running && coalescer != nullptr && ingest.error() == nullptr) {
+            coalescer->finish();
+            while (running && coalescer->pop(line)) running = send(line, modal);
+        }
+        if (error_ == nullptr) error_ = ingest.error();
+        done_.store(true, std::memory_order_release);
+        consumer_waiting_.store(false);
+        notify(consumer_event_);
+    }
+
+    SpscQueue<PreparedLine, LINE_QUEUE_CAPACITY> queue_;
+    PipelineConfig config_;
+    std::string pending_motion_;  // Motion mode still to be restored
+    std::string motion_line_;     // First move with the motion mode in front
+    GcodeIngest* ingest_ = nullptr;
+    std::thread thread_;
+    int consumer_event_ = -1;
+    int producer_event_ = -1;
+    std::atomic<bool> consumer_waiting_{false};
+    std::atomic<bool> producer_waiting_{false};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> done_{false};
+    const char* error_ = nullptr;
+};
+
+// Most lines that can be in flight: every line is at least one byte plus '\n'
+const size_t MAX_PENDING_LINES = MAX_RX_BUFFER_SIZE / 2;
+
+// Most lines gathered into one writev()
+const size_t MAX_WRITE_BATCH = 64;
+
+// Longest wait to finish a partially written line, or to get queued real-time
+// commands out, when a job stops
+const int UNSENT_FLUSH_TIMEOUT_MS = 1000;
+
+// Fixed-capacity FIFO stored inline. Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class FixedRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    bool empty() const { return head_ == tail_; }
+    bool full() const { return tail_ - head_ == Capacity; }
+    size_t size() const { return tail_ - head_; }
+
+    // Append item; the caller checks full() first
+    void push(const T& item) { slots_[tail_++ & (Capacity - 1)] = item; }
+
+    T& front() { return slots_[head_ & (Capacity - 1)]; }
+    void pop() { ++head_; }
+    void clear() { head_ = tail_ = 0; }
+
+private:
+    size_t head_ = 0;
+    size_t tail_ = 0;
+    T slots_[Capacity];
+};
+
+// How often the checkpoint file is rewritten while acks arrive
+const std::chrono::seconds CHECKPOINT_INTERVAL{1};
+
+// Progress of a job as of its last acknowledged line, kept in a small text
+// file so an interrupted job can be resumed. The file is replaced atomically
+// (write to a temporary file, then rename) and removed when the job completes.
+class JobCheckpoint {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t line_number = 0;  // Last acknowledged source line
+    uint64_t offset = 0;       // File offset of that line
+    ModalState modal;          // Modal state after that line
+    uint64_t file_size = 0;    // Size and mtime of the job when it started
+    int64_t file_mtime = 0;
+
+    explicit JobCheckpoint(const char* path) : path_(path) {}
+
+    // Remember the job file's identity so a resume can detect edits
+    bool identify(const char* gcode_path) {
+        struct stat st;
+        if (stat(gcode_path, &st) != 0) return false;
+        file_size = st.st_size;
+        file_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return true;
+    }
+
+    // Record an acknowledged line
+    void record(uint64_t line, uint64_t line_offset, const ModalState& state) {
+        line_number = line;
+        offset = line_offset;
+        modal = state;
+        dirty_ = true;
+    }
+
+    // Write the file if progress was made and the interval has passed
+    void saveIfDue(Clock::time_point now) {
+        if (dirty_ && now - last_save_ >= CHECKPOINT_INTERVAL) {
+            save();
+            last_save_ = now;
+        }
+    }
+
+    bool save() {
+        dirty_ = false;
+        std::string tmp = path_ + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (f == nullptr) return false;
+        fprintf(f, "grbl_streamer checkpoint 1\n");
+        fprintf(f, "size=%llu\nmtime=%lld\n", static_cast<unsigned long long>(file_size),
+                static_cast<long long>(file_mtime));
+        fprintf(f, "line=%llu\noffset=%llu\n", static_cast<unsigned long long>(line_number),
+                static_cast<unsigned long long>(offset));
+        fprintf(f, "motion=%d\nplane=%d\nunits=%d\ndistance=%d\nfeed_mode=%d\nwcs=%d\n", modal.motion,
+                modal.plane, modal.units, modal.distance, modal.feed_mode, modal.wcs);
+        fprintf(f, "spindle=%d\ncoolant=%d\nfeed=%.17g\nspeed=%.17g\n", modal.spindle, modal.coolant,
+                modal.feed, modal.speed);
+        if (fclose(f) != 0) return false;
+        return rename(tmp.c_str(), path_.c_str()) == 0;
+    }
+
+    // Read a checkpoint written by save(). Returns false if it is missing or
+    // not a checkpoint.
+    bool load() {
+        FILE* f = fopen(path_.c_str(), "r");
+        if (f == nullptr) return false;
+        char buf[128];
+        bool valid = fgets(buf, sizeof(buf), f) != nullptr && strcmp(buf, "grbl_streamer checkpoint 1\n") == 0;
+        while (valid && fgets(buf, sizeof(buf), f) != nullptr) {
+            char* eq = strchr(buf, '=');
+            if (eq == nullptr) continue;
+            *eq = '\0';
+            const char* value = eq + 1;
+            long long n = strtoll(value, nullptr, 10);
+            if (strcmp(buf, "size") == 0) file_size = n;
+            else if (strcmp(buf, "mtime") == 0) file_mtime = n;
+            else if (strcmp(buf, "line") == 0) line_number = n;
+            else if (strcmp(buf, "offset") == 0) offset = n;
+            else if (strcmp(buf, "motion") == 0) modal.motion = n;
+            else if (strcmp(buf, "plane") == 0) modal.plane = n;
+            else if (strcmp(buf, "units") == 0) modal.units = n;
+            else if (strcmp(buf, "distance") == 0) modal.distance = n;
+            else if (strcmp(buf, "feed_mode") == 0) modal.feed_mode = n;
+            else if (strcmp(buf, "wcs") == 0) modal.wcs = n;
+            else if (strcmp(buf, "spindle") == 0) modal.spindle = n;
+            else if (strcmp(buf, "coolant") == 0) modal.coolant = n;
+            else if (strcmp(buf, "feed") == 0) modal.feed = strtod(value, nullptr);
+            else if (strcmp(buf, "speed") == 0) modal.speed = strtod(value, nullptr);
+        }
+        fclose(f);
+        return valid && line_number > 0;
+    }
+
+    void remove() { unlink(path_.c_str()); }
+
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    bool dirty_ = false;
+    Clock::time_point last_save_;
+};
+
+// Set from the SIGUSR1 handler to request a statistics summary
+volatile sig_atomic_t g_stats_requested = 0;
+
+void handleStatsSignal(int) {
+    g_stats_requested = 1;
+}
+
+// Fixed-bucket latency histogram with four log-linear buckets per power of
+// two (about 19% resolution). Recording never allocates.
+class LatencyHistogram {
+public:
+    static constexpr int BUCKETS = 128;
+
+    void record(uint64_t us) {
+        int bucket = bucketFor(us);
+        ++counts_[bucket];
+        ++total_;
+        sum_ += us;
+        if (us > max_) max_ = us;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    uint64_t bucketCount(int bucket) const { return counts_[bucket]; }
+    double mean() const { return total_ > 0 ? static_cast<double>(sum_) / total_ : 0; }
+
+    // Upper bound of the bucket holding the p-th fraction of samples
+    uint64_t percentile(double p) const {
+        uint64_t target = static_cast<uint64_t>(p * total_ + 0.5);
+        if (target == 0) target = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts_[b];
+            if (seen >= target) return std::min(bucketLower(b + 1), max_);
+        }
+        return max_;
+    }
+
+    // Smallest value that falls into bucket
+    static uint64_t bucketLower(int bucket) {
+        if (bucket < 4) return bucket;
+        int shift = (bucket - 4) / 4;
+        return static_cast<uint64_t>(4 + (bucket - 4) % 4) << shift;
+    }
+
+private:
+    static int bucketFor(uint64_t value) {
+        if (value < 4) return static_cast<int>(value);
+        int msb = 63 - __builtin_clzll(value);
+        int bucket = 4 + (msb - 2) * 4 + static_cast<int>((value >> (msb - 2)) & 3);
+        return std::min(bucket, BUCKETS - 1);
+    }
+
+    uint64_t counts_[BUCKETS] = {};
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Share of the run the planner may spend starved by the host before the
+// summary calls it out
+const double HOST_STARVED_NOTE = 0.01;
+
+// Throughput and latency counters for one streaming session. The I/O loop
+// updates plain counters; formatting only happens in printSummary() and
+// writeFile().
+class StreamStats {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // What limited the stream while the event loop was waiting
+    enum WindowState {
+        WINDOW_EMPTY,    // Nothing buffered in the controller
+        WINDOW_PARTIAL,  // Room left but no line ready (host behind)
+        WINDOW_FULL,     // Next line does not fit (controller or link behind)
+        WINDOW_STATES
+    };
+
+    // Why the planner ran low, from the status report that showed it
+    enum PlannerState {
+        PLANNER_FED,      // Enough blocks queued, or nothing left to send
+        PLANNER_HOST,     // No line was ready to send (host starvation)
+        PLANNER_LINK,     // Lines were waiting for RX space (link or RX buffer limit)
+        PLANNER_STATES
+    };
+
+    StreamStats() : start_(Clock::now()), state_since_(start_) {}
+
+    uint64_t linesSent() const { return lines_sent_; }
+    uint64_t linesAcked() const { return lines_acked_; }
+    uint64_t bytesSent() const { return bytes_sent_; }
+    Clock::time_point startTime() const { return start_; }
+
+    double elapsedSeconds() const {
+        Clock::time_point end = (end_ == Clock::time_point()) ? Clock::now() : end_;
+        return std::chrono::duration<double>(end - start_).count();
+    }
+
+    void lineSent(size_t len) {
+        ++lines_sent_;
+        bytes_sent_ += len;
+    }
+
+    void lineAcked(Clock::time_point sent_at, Clock::time_point now) {
+        ++lines_acked_;
+        latency_.record(std::chrono::duration_cast<std::chrono::microseconds>(now - sent_at).count());
+    }
+
+    // Account the time since the last call to the previous state
+    void setWindowState(WindowState state, Clock::time_point now) {
+        state_time_[state_] += now - state_since_;
+        state_ = state;
+        state_since_ = now;
+    }
+
+    // Record a status report's planner fill and lookahead (blocks planned
+    // plus blocks still in the RX buffer); the time since the last report is
+    // accounted to the previous planner state
+    void plannerReport(int used, int lookahead, PlannerState state, Clock::time_point now) {
+        if (planner_since_ != Clock::time_point()) planner_time_[planner_state_] += now - planner_since_;
+        planner_state_ = state;
+        planner_since_ = now;
+        ++planner_reports_;
+        planner_used_sum_ += used;
+        lookahead_sum_ += lookahead;
+    }
+
+    void blocksSent(uint32_t blocks) { blocks_sent_ += blocks; }
+
+    void finish() {
+        Clock::time_point now = Clock::now();
+        setWindowState(state_, now);
+        if (planner_since_ != Clock::time_point()) plannerReport(0, 0, PLANNER_FED, now);
+        end_ = state_since_;
+    }
+
+    uint64_t reads = 0;   // read() calls on the port
+    uint64_t writes = 0;  // write() calls on the port
+    uint64_t polls = 0;   // Event loop wakeups for this job
+
+    // Print a human-readable summary
+    void printSummary(std::ostream& out) const {
+        Clock::time_point end = (end_ == Clock::time_point()) ? Clock::now() : end_;
+        double elapsed = std::chrono::duration<double>(end - start_).count();
+        double rate = elapsed > 0 ? 1 / elapsed : 0;
+        out << "Streamed " << lines_acked_ << " lines, " << bytes_sent_ << " bytes in " << elapsed << " s ("
+            << lines_acked_ * rate << " lines/s, " << bytes_sent_ * rate << " bytes/s)\n";
+        if (latency_.count() > 0) {
+            out << "Ack latency (us): mean " << static_cast<uint64_t>(latency_.mean())
+                << ", p50 " << latency_.percentile(0.5) << ", p90 " << latency_.percentile(0.9)
+                << ", p99 " << latency_.percentile(0.99) << ", max " << latency_.max() << "\n";
+        }
+        double total = 0;
+        for (int i = 0; i < WINDOW_STATES; ++i) total += stateSeconds(static_cast<WindowState>(i));
+        if (total > 0) {
+            out << "RX window: full " << 100 * stateSeconds(WINDOW_FULL) / total << "%, waiting for host "
+                << 100 * stateSeconds(WINDOW_PARTIAL) / total << "%, controller empty "
+                << 100 * stateSeconds(WINDOW_EMPTY) / total << "%\n";
+        }
+        if (planner_reports_ > 0 && elapsed > 0) {
+            double low = plannerSeconds(PLANNER_HOST) + plannerSeconds(PLANNER_LINK);
+            out << "Planner: " << plannerUsedMean() << " blocks queued on average (" << lookaheadMean()
+                << " with the RX buffer, " << (lines_sent_ > 0 ? blocks_sent_ / static_cast<double>(lines_sent_) : 0)
+                << " per line), low for " << 100 * low / elapsed << "% (host starved "
+                << 100 * plannerSeconds(PLANNER_HOST) / elapsed << "%, link limited "
+                << 100 * plannerSeconds(PLANNER_LINK) / elapsed << "%)\n";
+            if (plannerSeconds(PLANNER_HOST) >= HOST_STARVED_NOTE * elapsed) {
+                out << "The G-code source did not keep up: the planner ran dry waiting for lines\n";
+            }
+        }
+        out << "Syscalls: " << writes << " writes, " << reads << " reads, " << polls << " polls" << std::endl;
+    }
+
+    // Write all counters and the latency histogram as JSON (path ending in
+    // ".json") or as key,value CSV. Returns false if the file can't be written.
+    bool writeFile(const char* path) const {
+        FILE* f = fopen(path, "w");
+        if (f == nullptr) return false;
+        size_t len = strlen(path);
+        bool json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+        Clock::time_point end = (end_ == Clock::time_point()) ? Clock::now() : end_;
+        double elapsed = std::chrono::duration<double>(end - start_).count();
+
+        struct Field {
+            const char* key;
+            double value;
+        };
+        const Field fields[] = {
+            {"elapsed_s", elapsed},
+            {"lines_sent", static_cast<double>(lines_sent_)},
+            {"lines_acked", static_cast<double>(lines_acked_)},
+            {"bytes_sent", static_cast<double>(bytes_sent_)},
+            {"lines_per_s", elapsed > 0 ? lines_acked_ / elapsed : 0},
+            {"bytes_per_s", elapsed > 0 ? bytes_sent_ / elapsed : 0},
+            {"latency_mean_us", latency_.mean()},
+            {"latency_p50_us", static_cast<double>(latency_.percentile(0.5))},
+            {"latency_p90_us", static_cast<double>(latency_.percentile(0.9))},
+            {"latency_p99_us", static_cast<double>(latency_.percentile(0.99))},
+            {"latency_max_us", static_cast<double>(latency_.max())},
+            {"window_full_s", stateSeconds(WINDOW_FULL)},
+            {"window_partial_s", stateSeconds(WINDOW_PARTIAL)},
+            {"window_empty_s", stateSeconds(WINDOW_EMPTY)},
+            {"writes", static_cast<double>(writes)},
+            {"reads", static_cast<double>(reads)},
+            {"polls", static_cast<double>(polls)},
+            {"blocks_sent", static_cast<double>(blocks_sent_)},
+            {"planner_reports", static_cast<double>(planner_reports_)},
+            {"planner_used_mean", plannerUsedMean()},
+            {"planner_lookahead_mean", lookaheadMean()},
+            {"planner_host_starved_s", plannerSeconds(PLANNER_HOST)},
+            {"planner_link_limited_s", plannerSeconds(PLANNER_LINK)},
+        };
+
+        if (json) fprintf(f, "{\n");
+        else fprintf(f, "key,value\n");
+        for (const Field& field : fields) {
+            if (json) fprintf(f, "  \"%s\": %.9g,\n", field.key, field.value);
+            else fprintf(f, "%s,%.9g\n", field.key, field.value);
+        }
+        if (json) fprintf(f, "  \"latency_histogram_us\": [");
+        bool first = true;
+        for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+            uint64_t count = latency_.bucketCount(b);
+            if (count == 0) continue;
+            unsigned long long lower = LatencyHistogram::bucketLower(b);
+            if (json) {
+                fprintf(f, "%s\n    {\"from\": %llu, \"count\": %llu}", first ? "" : ",", lower,
+                        static_cast<unsigned long long>(count));
+            } else {
+                fprintf(f, "latency_from_%llu_us,%llu\n", lower, static_cast<unsigned long long>(count));
+            }
+            first = false;
+        }
+        if (json) fprintf(f, "\n  ]\n}\n");
+        return fclose(f) == 0;
+    }
+
+private:
+    double stateSeconds(WindowState state) const {
+        return std::chrono::duration<double>(state_time_[state]).count();
+    }
+    double plannerSeconds(PlannerState state) const {
+        return std::chrono::duration<double>(planner_time_[state]).count();
+    }
+    double plannerUsedMean() const { return planner_reports_ > 0 ? static_cast<double>(planner_used_sum_) / planner_reports_ : 0; }
+    double lookaheadMean() const { return planner_reports_ > 0 ? static_cast<double>(lookahead_sum_) / planner_reports_ : 0; }
+
+    Clock::time_point start_;
+    Clock::time_point end_;
+    Clock::time_point state_since_;
+    WindowState state_ = WINDOW_EMPTY;
+    Clock::duration state_time_[WINDOW_STATES] = {};
+    uint64_t lines_sent_ = 0;
+    uint64_t lines_acked_ = 0;
+    uint64_t bytes_sent_ = 0;
+    LatencyHistogram latency_;
+    uint64_t blocks_sent_ = 0;
+    Clock::time_point planner_since_;  // Time of the last status report, zero before the first
+    PlannerState planner_state_ = PLANNER_FED;
+    Clock::duration planner_time_[PLANNER_STATES] = {};
+    uint64_t planner_reports_ = 0;
+    uint64_t planner_used_sum_ = 0;
+    uint64_t lookahead_sum_ = 0;
+};
+
+// Kinds of log records, each formatted by AsyncLogger::format()
+enum LogEvent : uint8_t {
+    LOG_SEND,      // text: line, a: length, b: RX bytes available before it
+    LOG_ACK,       // a: bytes freed, b: RX bytes available after it
+    LOG_RESPONSE,  // text: response as received
+    LOG_STATUS,    // text: state, a: planner free, b: RX free, value: feed
+    LOG_REALTIME,  // a: real-time command byte
+};
+
+// A fixed-size log record; longer text is cut off
+struct LogRecord {
+    int64_t time_ns;  // Since the logger started
+    double value;
+    int32_t a;
+    int32_t b;
+    LogEvent event;
+    uint8_t len;
+    char text[102];
+};
+static_assert(sizeof(LogRecord) == 128, "log record layout");
+
+// Log records the streaming loop may run ahead of the logger thread
+const size_t LOG_RING_CAPACITY = 8192;
+
+// How often the logger thread formats what has been logged
+const std::chrono::milliseconds LOG_FLUSH_INTERVAL{20};
+
+// Asynchronous logger for the streaming loop. The I/O thread only copies a
+// binary record into a lock-free ring; a background thread formats the
+// records with timestamps and writes them out in batches. When the ring is
+// full records are dropped, never waited for, and the loss is reported in
+// the log. There is one producer: all streamers run on the event loop thread.
+class AsyncLogger {
+public:
+    AsyncLogger() = default;
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    ~AsyncLogger() { stop(); }
+
+    // Log to path, or to stdout if it is nullptr. Returns false if the file
+    // cannot be opened.
+    bool start(const char* path) {
+        out_ = (path != nullptr) ? fopen(path, "we") : stdout;
+        if (out_ == nullptr) return false;
+        start_ = std::chrono::steady_clock::now();
+        thread_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    // Write out everything logged so far and end the logger thread
+    void stop() {
+        if (!thread_.joinable()) return;
+        stopping_.store(true);
+        thread_.join();
+        if (out_ != stdout) fclose(out_);
+        out_ = nullptr;
+    }
+
+    // Producer: record an event, or drop it if the ring is full
+    void log(LogEvent event, std::string_view text, int32_t a = 0, int32_t b = 0, double value = 0) {
+        LogRecord* record = ring_.producerSlot();
+        if (record == nullptr) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record->time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start_).count();
+        record->event = event;
+        record->a = a;
+        record->b = b;
+        record->value = value;
+        record->len = static_cast<uint8_t>(std::min(text.size(), sizeof(record->text)));
+        memcpy(record->text, text.data(), record->len);
+        ring_.commit();
+    }
+
+private:
+    void run() {
+        uint64_t reported = 0;
+        while (true) {
+            bool last = stopping_.load();
+            while (LogRecord* record = ring_.front()) {
+                format(*record);
+                ring_.pop();
+            }
+            uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+            if (dropped != reported) {
+                fprintf(out_, "(%llu log records dropped)\n", static_cast<unsigned long long>(dropped - reported));
+                reported = dropped;
+            }
+            fflush(out_);
+            if (last) return;
+            std::this_thread::sleep_for(LOG_FLUSH_INTERVAL);
+        }
+    }
+
+    void format(const LogRecord& r) {
+        fprintf(out_, "[%11.6f] ", r.time_ns / 1e9);
+        std::string_view text(r.text, r.len);
+        int len = static_cast<int>(r.len);
+        switch (r.event) {
+            case LOG_SEND:
+                // The record holds the line without its '\n'; longer lines end in "..."
+                fprintf(out_, "Sending: %.*s%s (len: %d, available: %d)\n", len, r.text,
+                        r.a > len + 1 ? "..." : "", r.a, r.b);
+                break;
+            case LOG_ACK:
+                fprintf(out_, "Received ok, freed %d bytes (available now: %d)\n", r.a, r.b);
+                break;
+            case LOG_RESPONSE:
+                text = trimWhitespace(text);
+                fprintf(out_, "%.*s\n", static_cast<int>(text.size()), text.data());
+                break;
+            case LOG_STATUS:
+                fprintf(out_, "Status: %.*s (planner free: %d, rx free: %d, feed: %g)\n", len, r.text, r.a, r.b,
+                        r.value);
+                break;
+            case LOG_REALTIME:
+                fprintf(out_, "Real-time command 0x%02X\n", static_cast<unsigned>(r.a));
+                break;
+        }
+    }
+
+    SpscQueue<LogRecord, LOG_RING_CAPACITY> ring_;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> stopping_{false};
+    std::chrono::steady_clock::time_point start_;
+    FILE* out_ = nullptr;
+    std::thread thread_;
+};
+
+// True if events of Level are compiled in and log is active. Disabled
+// levels fold to false, so their log calls are removed entirely.
+template <int Level>
+inline bool logEnabled(const AsyncLogger* log) {
+    if constexpr (Level > GRBL_LOG_LEVEL) {
+        return false;
+    } else {
+        return log != nullptr;
+    }
+}
+
+// GRBL's soft reset real-time command
+const char REALTIME_RESET = 0x18;
+
+// Function to tell whether a byte is a GRBL real-time command
+bool isRealtimeCommand(unsigned char c) {
+    return c == '!' || c == '~' || c == '?' || c == REALTIME_RESET || c >= 0x80;
+}
+
+// Exit codes of a job; setup, port and file errors exit with 1
+const int EXIT_GRBL_ERROR = 2;      // Halted on an error: response
+const int EXIT_GRBL_ALARM = 3;      // Halted on an alarm, or the controller reset
+const int EXIT_ABORTED = 4;         // Soft reset from the control socket
+const int EXIT_ERRORS_SKIPPED = 5;  // Completed, but lines were skipped after errors
+
+// What a job does when GRBL answers a line with error:N
+struct ErrorPolicy {
+    enum Action {
+        HALT,   // Stop the job
+        SKIP,   // Count the line as done and go on
+        PAUSE,  // Feed hold, then wait for '~' (go on) or 0x18 (stop) on the control socket
+    };
+    Action action = HALT;
+    std::vector<int> codes;  // With SKIP, the codes skipped (others halt); empty for all
+
+    Action actionFor(int code) const {
+        if (action != SKIP || codes.empty()) return action;
+        return std::find(codes.begin(), codes.end(), code) != codes.end() ? SKIP : HALT;
+    }
+};
+
+// Function to parse "halt", "pause", "skip" or "skip:N,M,...". Returns false
+// if spec is none of them.
+bool parseErrorPolicy(std::string_view spec, ErrorPolicy& policy) {
+    policy = ErrorPolicy();
+    if (spec == "halt") return true;
+    if (spec == "pause") {
+        policy.action = ErrorPolicy::PAUSE;
+        return true;
+    }
+    if (spec.substr(0, 4) != "skip") return false;
+    policy.action = ErrorPolicy::SKIP;
+    if (spec.size() == 4) return true;
+    if (spec[4] != ':') return false;
+    spec.remove_prefix(5);
+    while (true) {
+        int code;
+        auto [end, ec] = std::from_chars(spec.data(), spec.data() + spec.size(), code);
+        if (ec != std::errc() || code <= 0) return false;
+        policy.codes.push_back(code);
+        spec.remove_prefix(end - spec.data());
+        if (spec.empty()) return true;
+        if (spec.front() != ',') return false;
+        spec.remove_prefix(1);
+    }
+}
+
+// Layout version of the shared-memory statistics; bumped on any change
+const uint32_t SHARED_STATS_VERSION = 1;
+
+// Name of a job's shared-memory statistics, followed by its device's name
+const char SHARED_STATS_PREFIX[] = "/grbl_streamer.";
+
+// Live statistics of one job in shared memory (/dev/shm/grbl_streamer.<tty>).
+// The streamer is the only writer and publishes with plain stores under a
+// sequence lock: sequence is odd while values is being written, so a reader
+// copies values and retries if sequence was odd or changed meanwhile.
+// Publishing never waits for a reader.
+struct SharedStats {
+    char magic[8];                   // "GSSTATS"
+    uint32_t version;                // SHARED_STATS_VERSION
+    uint32_t size;                   // sizeof(SharedStats)
+    int32_t pid;                     // Process publishing the statistics
+    std::atomic<uint32_t> sequence;
+    struct Values {
+        uint64_t updated_ns;         // steady (CLOCK_MONOTONIC) time of this update
+        uint64_t started_ns;         // ... of the start of the job
+        uint64_t status_ns;          // ... of the last status report, 0 for none
+        uint64_t lines_sent;
+        uint64_t lines_acked;
+        uint64_t bytes_sent;
+        uint64_t errors_skipped;
+        uint64_t last_line;          // Source line of the last line answered
+        uint64_t status_reports;
+        uint32_t rx_size;            // RX window in bytes
+        uint32_t rx_used;            // Bytes of it taken by pending lines
+        uint32_t pending;            // Lines sent and not answered yet
+        int32_t exit_code;           // Exit code of the job, -1 while it runs
+        int32_t planner_free;        // From the last status report, -1 if unknown
+        int32_t rx_free;
+        double feed;
+        double mpos[MAX_AXES];
+        char state[16];
+    } values;
+};
+
+// Owner of the shared-memory statistics of one job; the segment is removed
+// again when the job ends
+class SharedStatsSegment {
+public:
+    SharedStatsSegment() = default;
+    SharedStatsSegment(const SharedStatsSegment&) = delete;
+    SharedStatsSegment& operator=(const SharedStatsSegment&) = delete;
+
+    ~SharedStatsSegment() {
+        if (shared_ != nullptr) {
+            munmap(shared_, sizeof(SharedStats));
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    // Function to get the segment name of a device ("/grbl_streamer.ttyUSB0")
+    static std::string nameFor(const std::string& device) {
+        return SHARED_STATS_PREFIX + device.substr(device.rfind('/') + 1);
+    }
+
+    bool open(const std::string& device) {
+        name_ = nameFor(device);
+        int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd == -1) return false;
+        // Truncating first clears what an earlier run left behind
+        bool sized = ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(SharedStats)) == 0;
+        void* map = sized ? mmap(nullptr, sizeof(SharedStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map == MAP_FAILED) {
+            shm_unlink(name_.c_str());
+            return false;
+        }
+        shared_ = static_cast<SharedStats*>(map);
+        memcpy(shared_->magic, "GSSTATS", 8);
+        shared_->version = SHARED_STATS_VERSION;
+        shared_->size = sizeof(SharedStats);
+        shared_->pid = getpid();
+        shared_->values.exit_code = -1;
+        return true;
+    }
+
+    // Called from the I/O loop only
+    void publish(const SharedStats::Values& values) {
+        uint32_t sequence = shared_->sequence.load(std::memory_order_relaxed);
+        shared_->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        shared_->values = values;
+        shared_->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Function to take a consistent copy of the values a segment holds
+    static void read(const SharedStats& shared, SharedStats::Values& values) {
+        while (true) {
+            uint32_t before = shared.sequence.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                memcpy(&values, const_cast<const SharedStats::Values*>(&shared.values), sizeof(values));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (shared.sequence.load(std::memory_order_relaxed) == before) return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    std::string name_;
+    SharedStats* shared_ = nullptr;
+};
+
+// Settings for one streaming session
+struct StreamOptions {
+    AsyncLogger* log = nullptr;       // Per-line log in verbose mode
+    ErrorPolicy on_error;             // What to do on an error: response
+    double status_hz = 0;             // Rate of '?' status queries, 0 to disable
+    int rx_buffer = RX_BUFFER_SIZE;   // Usable bytes in the controller's RX buffer
+    bool rx_verify = false;           // Check the local count against status Bf:
+    JobCheckpoint* checkpoint = nullptr;  // Record acknowledged progress here
+    int forward_fd = -1;              // Copy every controller response to this socket
+    bool planner_aware = false;       // Track the planner fill from status reports
+    int planner_blocks = 0;           // Planner size, 0 to learn it from status reports
+    const LineIndex* index = nullptr; // Line index of the job, for progress
+    bool progress = false;            // Print progress and time left periodically
+    bool label = false;               // Prefix progress lines with the device name
+    SharedStatsSegment* shared_stats = nullptr;  // Publish live statistics here
+};
+
+// Interval of progress lines with --progress
+const std::chrono::seconds PROGRESS_INTERVAL{5};
+
+// Planner fill, as a share of its blocks, below which the planner runs low
+const double PLANNER_LOW_FILL = 0.25;
+
+// Status query rate in planner-aware mode when -q is not given
+const double PLANNER_STATUS_HZ = 10;
+
+// Forwarded bytes a bridge client may fall behind by before status reports
+// are dropped for it
+const size_t MAX_FORWARD_BACKLOG = 64 * 1024;
+
+// I/O side of the streaming pipeline: owns the serial port and implements
+// GRBL character-counting flow control for one job. It is driven by the
+// EventLoop, which waits on the port (read, and write when a send would
+// block) and on the line queue; every batch of acks immediately frees buffer
+// space for the next send.
+// Status queries are real-time bytes: they are sent on a timer outside the
+// character count and their reports never reach the ack matching. With
+// rx_verify, the RX free count in each report is checked against the local
+// count and the window is corrected when they drift apart.
+// As a network bridge, every response is also copied to the client, batched
+// into one write per event loop pass.
+// In planner-aware mode every line carries the planner blocks it makes, so
+// the lookahead GRBL has (blocks planned from Bf: plus blocks still in the RX
+// buffer) is known at each status report. Whenever the planner runs low, the
+// time is accounted to the host (no line was ready) or to the link (lines
+// were waiting for RX space).
+class Streamer {
+public:
+    Streamer(const std::string& name, int fd, SerialLineReader& reader, LinePipeline& pipeline,
+             const StreamOptions& options)
+        : name_(name), fd_(fd), reader_(reader), pipeline_(pipeline), log_(options.log), policy_(options.on_error),
+          rx_size_(options.rx_buffer), rx_verify_(options.rx_verify), checkpoint_(options.checkpoint),
+          forward_fd_(options.forward_fd), planner_aware_(options.planner_aware),
+          planner_size_(options.planner_blocks), index_(options.index), label_(options.label),
+          shared_stats_(options.shared_stats), available_(options.rx_buffer) {
+        if (options.status_hz > 0) {
+            status_interval_ = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(1.0 / options.status_hz));
+            next_status_ = Clock::now();
+        }
+        if (options.progress && index_ != nullptr) next_progress_ = Clock::now() + PROGRESS_INTERVAL;
+    }
+
+    // Last status report received from GRBL
+    const GrblStatus& status() const { return status_; }
+
+    StreamStats& stats() { return stats_; }
+
+    // True if every line was sent and acknowledged
+    bool completed() const { return completed_; }
+
+    // Lines sent but not answered yet; after a halt the controller still
+    // answers each of them
+    size_t pendingLines() const { return pending_.size(); }
+
+    // Port and queue descriptors the event loop waits on
+    int serialFd() const { return fd_; }
+    int queueFd() const { return pipeline_.eventFd(); }
+
+    // Name used to label output when several jobs run at once
+    const std::string& name() const { return name_; }
+
+    // True while a send is waiting for the port to become writable
+    bool wantsWrite() const { return write_blocked_; }
+
+    // True once the job has completed or stopped
+    bool finished() const { return finished_; }
+
+    // Exit code for the job, valid once finished() is true
+    int exitCode() const { return return_code_; }
+
+    // Lines rejected with an error that the policy passed over
+    uint64_t errorsSkipped() const { return errors_skipped_; }
+
+    // The first MAX_REPORTED_ISSUES of them, with the controller's answer
+    const std::vector<ValidationIssue>& rejectedLines() const { return rejected_; }
+
+    // Print how far the job is, from the line index: share of bytes acknowledged
+    // and the time left. The estimate of the run time is scaled by how fast
+    // the job has run compared with it so far.
+    void printProgress(std::ostream& out) const {
+        if (index_ == nullptr || index_->lines() == 0) return;
+        uint64_t base = first_line_ > 0 ? first_line_ - 1 : 0;  // Lines before a resume
+        uint64_t done = std::max(last_acked_line_, base);
+        uint64_t last = index_->lines();
+        uint64_t total_bytes = index_->bytesThrough(last) - index_->bytesThrough(base);
+        uint64_t done_bytes = index_->bytesThrough(done) - index_->bytesThrough(base);
+        double done_estimate = index_->secondsThrough(done) - index_->secondsThrough(base);
+        double left_estimate = index_->secondsThrough(last) - index_->secondsThrough(done);
+        double elapsed = stats_.elapsedSeconds();
+        double left;
+        if (done_estimate >= 1) {
+            left = left_estimate * elapsed / done_estimate;
+        } else if (done_bytes > 0) {
+            left = (total_bytes - done_bytes) * elapsed / done_bytes;  // No feeds to go by yet
+        } else {
+            left = left_estimate;
+        }
+        if (label_) out << "[" << name_ << "] ";
+        out << "Progress: " << (total_bytes > 0 ? 100.0 * done_bytes / total_bytes : 100.0) << "% (line "
+            << done << " of " << last << "), " << formatDuration(left) << " left" << std::endl;
+    }
+
+    // Send a real-time command ('!', '~', '?', 0x18 or an extended byte from
+    // 0x80) right away. GRBL picks these out of the serial stream even in
+    // the middle of a line, so they skip the RX window, wait for no ack and
+    // go out ahead of the rest of a partially written line. A soft reset
+    // drops everything the controller buffered, so the job stops.
+    void sendRealtime(char command) {
+        if (finished_) return;
+        if (logEnabled<LOG_DEBUG>(log_)) log_->log(LOG_REALTIME, {}, static_cast<uint8_t>(command));
+        realtime_.push_back(command);
+        if (!sendRealtimeBytes()) {
+            stop(1);
+            return;
+        }
+        if (command == REALTIME_RESET && !halted_) {
+            std::cerr << "Soft reset sent to " << name_ << ". Stopping the job." << std::endl;
+            unsent_len_ = unsent_pos_ = 0;  // After a reset the rest would be a line of its own
+            return_code_ = EXIT_ABORTED;
+            halted_ = true;
+        } else if (command == '~' && paused_) {
+            std::cerr << "Cycle start: " << name_ << " goes on after the error." << std::endl;
+            paused_ = false;
+        }
+    }
+
+    // Event handlers called by the event loop
+    void onReadable() {
+        if (!readResponses()) stop(1);
+    }
+    void onWritable() { write_blocked_ = false; }
+    void onQueueEvent() { pipeline_.clearEvent(); }
+
+    // Do all work that is possible right now: send lines that fit, send a
+    // due status query and check for the end of the job. Returns the
+    // milliseconds until service() has timer work again (-1 for none).
+    int service() {
+        if (finished_) return -1;
+        if (!sendLines()) {
+            stop(1);
+            return -1;
+        }
+        if (halted_) {
+            stop(return_code_);
+            return -1;
+        }
+
+        // If no more lines to send and no pending acknowledgments, done
+        if (pipeline_.finished() && pending_.empty()) {
+            if (pipeline_.error() != nullptr) {
+                std::cerr << "Error reading G-code file: " << pipeline_.error() << std::endl;
+                stop(1);
+                return -1;
+            }
+            completed_ = true;
+            stop(errors_skipped_ > 0 ? EXIT_ERRORS_SKIPPED : return_code_);
+            return -1;
+        }
+
+        if (!pollStatus()) {
+            stop(1);
+            return -1;
+        }
+        Clock::time_point now = Clock::now();
+        stats_.setWindowState(windowState(), now);
+        if (shared_stats_ != nullptr) publishStats(now);
+        if (next_progress_ != Clock::time_point() && now >= next_progress_) {
+            printProgress(std::cout);
+            next_progress_ = now + PROGRESS_INTERVAL;
+        }
+        flushForwarded(false);
+        return pollTimeout();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // A line sent to the controller and waiting for its ok or error
+    struct PendingLine {
+        uint16_t len;              // Bytes it occupies in the RX buffer
+        uint64_t line_number;      // Source line number
+        uint64_t offset;           // Source file offset
+        Clock::time_point sent_at;
+        ModalState modal;          // Modal state once this line has executed
+        uint16_t blocks;           // Planner blocks it makes
+        uint32_t dwell_ms;         // G4 dwell; GRBL holds back the ok until it ends
+    };
+
+    // Dwell of a prepared line in ms (G4 P is in seconds), 0 if it has none
+    static uint32_t dwellMs(const PreparedLine& line) {
+        std::string_view text(line.text, line.len - 1);
+        if (text.empty() || text.front() == '$' || text.find_first_of("Pp") == std::string_view::npos) return 0;
+        bool dwell = false;
+        double seconds = 0;
+        GcodeWord word;
+        size_t pos = 0;
+        while (parseGcodeWord(text, pos, word)) {
+            if (word.letter == 'G' && gcodeCode(word) == 40) dwell = true;
+            else if (word.letter == 'P') seconds = word.value;
+        }
+        if (!dwell || seconds <= 0) return 0;
+        return static_cast<uint32_t>(std::min(seconds * 1000, static_cast<double>(UINT32_MAX)));
+    }
+
+    // What the stream is waiting on right now
+    StreamStats::WindowState windowState() {
+        if (pending_.empty()) return StreamStats::WINDOW_EMPTY;
+        PreparedLine* next = pipeline_.front();
+        if (next != nullptr && next->len > available_) return StreamStats::WINDOW_FULL;
+        return StreamStats::WINDOW_PARTIAL;
+    }
+
+    // Send a '?' status query when one is due. Returns false on a fatal error.
+    bool pollStatus() {
+        if (status_interval_ == Clock::duration::zero() || write_blocked_) return true;
+        Clock::time_point now = Clock::now();
+        if (now < next_status_) return true;
+        ++stats_.writes;
+        ssize_t written = serialWrite(fd_, "?", 1);
+        if (written < 0 && errno == EAGAIN) {
+            write_blocked_ = true;
+            return true;
+        }
+        if (written != 1) {
+            std::cerr << "Error writing to serial port." << std::endl;
+            return false;
+        }
+        next_status_ += status_interval_;
+        if (next_status_ < now) next_status_ = now + status_interval_;
+        return true;
+    }
+
+    // Milliseconds the event loop may sleep before the next timer is due (-1 for none)
+    int pollTimeout() const {
+        Clock::time_point next = next_progress_;
+        if (status_interval_ != Clock::duration::zero() && !write_blocked_ &&
+            (next == Clock::time_point() || next_status_ < next)) {
+            next = next_status_;
+        }
+        if (next == Clock::time_point()) return -1;
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - Clock::now());
+        return static_cast<int>(std::max<std::chrono::milliseconds::rep>(0, wait.count()));
+    }
+
+    // Send as many queued lines as fit in the RX buffer, gathered into one
+    // writev() per batch. A line the port only took part of counts as sent;
+    // its rest is written first once the port is writable again. Returns
+    // false on a fatal error.
+    bool sendLines() {
+        if (!realtime_.empty() && !sendRealtimeBytes()) return false;
+        if (unsent_len_ > 0 && !sendUnsent()) return false;
+        while (!write_blocked_ && unsent_len_ == 0 && !halted_ && !paused_ && available_ > 0 && !pending_.full()) {
+            struct iovec iov[MAX_WRITE_BATCH];
+            PreparedLine* batch[MAX_WRITE_BATCH];
+            size_t count = 0;
+            size_t room = MAX_PENDING_LINES - pending_.size();
+            size_t free_bytes = available_;
+            while (count < MAX_WRITE_BATCH && count < room) {
+                PreparedLine* line = count == 0 ? pipeline_.front() : pipeline_.peek(count);
+                if (line == nullptr) break;
+
+                size_t len = line->len;
+                if (len > static_cast<size_t>(rx_size_)) {
+                    if (count > 0) break;  // Reported once the lines before it are out
+                    std::cerr << "Line " << line->line_number << " is longer than the GRBL RX buffer ("
+                              << rx_size_ << " bytes)." << std::endl;
+                    return false;
+                }
+                if (len > free_bytes) {
+                    // Cannot send yet, the line stays queued for after the next ack
+                    break;
+                }
+                iov[count].iov_base = line->text;
+                iov[count].iov_len = len;
+                batch[count++] = line;
+                free_bytes -= len;
+            }
+            if (count == 0) break;
+
+            ++stats_.writes;
+            ssize_t written = serialWritev(fd_, iov, static_cast<int>(count));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) {
+                    write_blocked_ = true;
+                    break;
+                }
+                perror("Error writing to serial port");
+                return false;
+            }
+
+            size_t remaining = written;
+            for (size_t i = 0; i < count && remaining > 0; ++i) {
+                PreparedLine* line = batch[i];
+                size_t len = line->len;
+                if (remaining < len) {
+                    // The port is full: keep the rest and wait for POLLOUT
+                    unsent_len_ = len - remaining;
+                    memcpy(unsent_, line->text + remaining, unsent_len_);
+                    unsent_pos_ = 0;
+                    write_blocked_ = true;
+                    remaining = 0;
+                } else {
+                    remaining -= len;
+                }
+                lineWritten(*line);
+            }
+        }
+        return true;
+    }
+
+    // Write waiting real-time commands. Returns false on a fatal error.
+    bool sendRealtimeBytes() {
+        while (!realtime_.empty()) {
+            ++stats_.writes;
+            ssize_t written = serialWrite(fd_, realtime_.data(), realtime_.size());
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) {
+                    write_blocked_ = true;
+                    return true;
+                }
+                perror("Error writing to serial port");
+                return false;
+            }
+            realtime_.erase(0, written);
+        }
+        return true;
+    }
+
+    // Write the rest of a partially sent line. Returns false on a fatal error.
+    bool sendUnsent() {
+        while (unsent_pos_ < unsent_len_) {
+            ++stats_.writes;
+            ssize_t written = serialWrite(fd_, unsent_ + unsent_pos_, unsent_len_ - unsent_pos_);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) {
+                    write_blocked_ = true;
+                    return true;
+                }
+                perror("Error writing to serial port");
+                return false;
+            }
+            unsent_pos_ += written;
+        }
+        unsent_len_ = unsent_pos_ = 0;
+        return true;
+    }
+
+    // Account for a line handed to the port and release its queue slot
+    void lineWritten(const PreparedLine& line) {
+        if (logEnabled<LOG_TRACE>(log_)) {
+            log_->log(LOG_SEND, std::string_view(line.text, line.len - 1), line.len, available_);
+        }
+        available_ -= line.len;
+        uint32_t dwell_ms = dwellMs(line);
+        pending_.push({line.len, line.line_number, line.offset, Clock::now(), line.modal, line.blocks, dwell_ms});
+        blocks_in_rx_ += line.blocks;
+        dwell_pending_ms_ += dwell_ms;
+        if (first_line_ == 0) first_line_ = line.line_number;
+        stats_.lineSent(line.len);
+        stats_.blocksSent(line.blocks);
+        pipeline_.pop();
+    }
+
+    // Drain the port and handle every complete response. Returns false on a
+    // fatal read error.
+    bool readResponses() {
+        ++stats_.reads;
+        ssize_t n = reader_.fill();
+        if (n == 0) {
+            std::cerr << "Serial port closed." << std::endl;
+            return false;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("read");
+            return false;
+        }
+        std::string_view response;
+        while (!halted_ && reader_.nextLine(response)) {
+            handleResponse(response);
+        }
+        return true;
+    }
+
+    void handleResponse(std::string_view response) {
+        if (forward_fd_ != -1 && (forwarded_.size() < MAX_FORWARD_BACKLOG || response.front() != '<')) {
+            forwarded_.append(response);
+        }
+
+        // Trim whitespace
+        response = trimWhitespace(response);
+        if (response.empty()) return;
+        if (logEnabled<LOG_DEBUG>(log_)) log_->log(LOG_RESPONSE, response);
+
+        Response kind = classifyResponse(response);
+        switch (kind.kind) {
+            case RESPONSE_OK:
+                lineAccepted();
+                break;
+            case RESPONSE_ERROR:
+                handleError(response, kind.code);
+                break;
+            case RESPONSE_ALARM:
+                // The controller rejects everything until it is unlocked
+                std::cerr << "GRBL alarm: " << response << " Halting execution." << std::endl;
+                return_code_ = EXIT_GRBL_ALARM;
+                halted_ = true;
+                break;
+            case RESPONSE_STATUS:
+                // Status reports answer our '?' queries, not a queued line
+                handleStatus(response);
+                break;
+            case RESPONSE_BANNER:
+                if (!pending_.empty()) {
+                    // A reset dropped every line the controller had buffered
+                    std::cerr << "GRBL was reset while streaming: " << response << " Halting execution."
+                              << std::endl;
+                    return_code_ = EXIT_GRBL_ALARM;
+                    halted_ = true;
+                }
+                break;
+            case RESPONSE_FEEDBACK:
+            case RESPONSE_SETTING:
+            case RESPONSE_OTHER:
+                // Informational; already echoed in verbose mode
+                break;
+        }
+    }
+
+    // The oldest pending line was answered, ok or error: the controller has
+    // taken it out of its RX buffer, so its bytes are free again
+    PendingLine releaseLine() {
+        PendingLine pending = pending_.front();
+        pending_.pop();
+        available_ += pending.len;
+        blocks_in_rx_ -= pending.blocks;
+        dwell_pending_ms_ -= pending.dwell_ms;
+        idle_since_ = Clock::time_point();
+        if (pending_.empty() && withheld_ > 0) {
+            // Everything sent has been answered: the window is in sync again
+            available_ = rx_size_;
+            withheld_ = 0;
+        }
+        return pending;
+    }
+
+    // The line is done with: record the progress
+    void lineDone(const PendingLine& pending, Clock::time_point now) {
+        if (pending.line_number == 0) return;
+        last_acked_line_ = pending.line_number;
+        if (checkpoint_ != nullptr) {
+            checkpoint_->record(pending.line_number, pending.offset, pending.modal);
+            checkpoint_->saveIfDue(now);
+        }
+    }
+
+    // The oldest pending line was acknowledged
+    void lineAccepted() {
+        if (pending_.empty()) return;
+        PendingLine pending = releaseLine();
+        Clock::time_point now = Clock::now();
+        stats_.lineAcked(pending.sent_at, now);
+        lineDone(pending, now);
+        if (logEnabled<LOG_TRACE>(log_)) log_->log(LOG_ACK, {}, pending.len, available_);
+    }
+
+    // The oldest pending line was rejected: apply the error policy
+    void handleError(std::string_view response, int code) {
+        if (pending_.empty()) {
+            std::cerr << "GRBL error detected: " << response << " Halting execution." << std::endl;
+            return_code_ = EXIT_GRBL_ERROR;
+            halted_ = true;
+            return;
+        }
+        PendingLine pending = releaseLine();
+        std::cerr << "GRBL error detected: " << response << " at line " << pending.line_number << " (offset "
+                  << pending.offset << ").";
+        ErrorPolicy::Action action = policy_.actionFor(code);
+        if (action != ErrorPolicy::HALT) {
+            ++errors_skipped_;
+            if (rejected_.size() < MAX_REPORTED_ISSUES) rejected_.push_back({pending.line_number, std::string(response)});
+            lineDone(pending, Clock::now());
+        }
+        switch (action) {
+            case ErrorPolicy::SKIP:
+                std::cerr << " Skipped the line (" << errors_skipped_ << " so far)." << std::endl;
+                break;
+            case ErrorPolicy::PAUSE:
+                std::cerr << " Feed hold; send '~' to the control socket to go on without the line, or 0x18"
+                          << " to stop." << std::endl;
+                if (!paused_) {
+                    paused_ = true;
+                    sendRealtime('!');
+                }
+                break;
+            case ErrorPolicy::HALT:
+                std::cerr << " Halting execution." << std::endl;
+                return_code_ = EXIT_GRBL_ERROR;
+                halted_ = true;
+                break;
+        }
+    }
+
+    // Parse a status report and check the RX window against it
+    void handleStatus(std::string_view report) {
+        status_.rx_free = -1;
+        if (parseStatusReport(report, status_)) {
+            status_at_ = Clock::now();
+            if (logEnabled<LOG_DEBUG>(log_)) {
+                log_->log(LOG_STATUS, status_.state, status_.planner_free, status_.rx_free, status_.feed);
+            }
+            if (rx_verify_ && status_.rx_free >= 0) verifyRxWindow();
+            if (planner_aware_ && status_.planner_free >= 0) trackPlanner();
+        }
+    }
+
+    // Relate the planner fill in a status report to what the host had ready
+    void trackPlanner() {
+        planner_size_ = std::max(planner_size_, status_.planner_free);  // An empty planner shows its size
+        int used = planner_size_ - status_.planner_free;
+        StreamStats::PlannerState state = StreamStats::PLANNER_FED;
+        bool moving = strncmp(status_.state, "Run", 3) == 0 || strncmp(status_.state, "Idle", 4) == 0;
+        if (moving && stats_.linesSent() > 0 && used < PLANNER_LOW_FILL * planner_size_) {
+            PreparedLine* next = pipeline_.front();
+            if (next == nullptr) {
+                if (!pipeline_.done()) state = StreamStats::PLANNER_HOST;
+            } else if (next->len > available_) {
+                state = StreamStats::PLANNER_LINK;
+            }
+        }
+        stats_.plannerReport(used, used + static_cast<int>(blocks_in_rx_), state, Clock::now());
+    }
+
+    // Compare the local window with the controller's reported free RX bytes.
+    // Every byte the controller still holds is also counted locally (acks
+    // for it arrive after this report), so the controller can never report
+    // less free space than we believe is available. If it does, an ack was
+    // miscounted: withhold the difference until the pending queue drains.
+    // A controller that stays idle with nothing buffered while lines are
+    // still pending has lost acks, and the window is reset. GRBL reports Idle
+    // while a G4 holds back its ok, so pending dwells extend the wait.
+    void verifyRxWindow() {
+        int controller_free = status_.rx_free - 1;  // GRBL keeps one byte of its ring empty
+        if (controller_free < available_) {
+            int drift = available_ - controller_free;
+            available_ -= drift;
+            withheld_ += drift;
+            ++drift_corrections_;
+            std::cerr << "RX window drift: controller has " << controller_free << " bytes free, local count "
+                      << (available_ + drift) << "; holding back " << drift << " bytes." << std::endl;
+        }
+
+        bool idle_empty = !pending_.empty() && controller_free >= rx_size_ &&
+                          strncmp(status_.state, "Idle", 4) == 0;
+        if (!idle_empty) {
+            idle_since_ = Clock::time_point();
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        if (idle_since_ == Clock::time_point()) {
+            idle_since_ = now;
+        } else if (now - idle_since_ >= IDLE_RESYNC_DELAY + std::chrono::milliseconds(dwell_pending_ms_)) {
+            std::cerr << "RX window drift: controller is idle with " << pending_.size()
+                      << " lines unacknowledged; resynchronising." << std::endl;
+            pending_.clear();
+            available_ = rx_size_;
+            withheld_ = 0;
+            blocks_in_rx_ = 0;
+            dwell_pending_ms_ = 0;
+            idle_since_ = Clock::time_point();
+            ++drift_corrections_;
+        }
+    }
+
+    // How long the controller must look idle and empty before pending acks are given up on
+    static constexpr std::chrono::seconds IDLE_RESYNC_DELAY{2};
+
+    void stop(int return_code) {
+        // Real-time commands go first: a queued soft reset is what stops the job
+        while (!realtime_.empty() && sendRealtimeBytes() && write_blocked_) {
+            struct pollfd pfd = {fd_, POLLOUT, 0};
+            if (poll(&pfd, 1, UNSENT_FLUSH_TIMEOUT_MS) <= 0) break;
+            write_blocked_ = false;
+        }
+        if (!realtime_.empty()) {
+            std::cerr << "Error: " << realtime_.size() << " real-time command byte(s) could not be written to "
+                      << name_ << (realtime_.find(REALTIME_RESET) != std::string::npos
+                                       ? "; the soft reset did not reach the controller."
+                                       : ".")
+                      << std::endl;
+            realtime_.clear();
+            return_code = 1;
+        }
+        // Never leave half a line in the controller's buffer
+        while (unsent_len_ > 0 && sendUnsent() && write_blocked_) {
+            struct pollfd pfd = {fd_, POLLOUT, 0};
+            if (poll(&pfd, 1, UNSENT_FLUSH_TIMEOUT_MS) <= 0) break;
+            write_blocked_ = false;
+        }
+        finished_ = true;
+        return_code_ = return_code;
+        stats_.finish();
+        if (shared_stats_ != nullptr) publishStats(Clock::now());
+        flushForwarded(true);
+    }
+
+    // Copy the live statistics to the shared-memory segment
+    void publishStats(Clock::time_point now) {
+        auto ns = [](Clock::time_point t) {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+        };
+        SharedStats::Values values = {};
+        values.updated_ns = ns(now);
+        values.started_ns = ns(stats_.startTime());
+        values.status_ns = status_at_ != Clock::time_point() ? ns(status_at_) : 0;
+        values.lines_sent = stats_.linesSent();
+        values.lines_acked = stats_.linesAcked();
+        values.bytes_sent = stats_.bytesSent();
+        values.errors_skipped = errors_skipped_;
+        values.last_line = last_acked_line_;
+        values.status_reports = status_.reports;
+        values.rx_size = rx_size_;
+        values.rx_used = rx_size_ - available_;
+        values.pending = pending_.size();
+        values.exit_code = finished_ ? return_code_ : -1;
+        values.planner_free = status_.planner_free;
+        values.rx_free = status_.rx_free;
+        values.feed = status_.feed;
+        memcpy(values.mpos, status_.mpos, sizeof(values.mpos));
+        memcpy(values.state, status_.state, sizeof(values.state));
+        shared_stats_->publish(values);
+    }
+
+    // Send the responses collected for the bridge client in one write. A
+    // client that stops reading only loses status reports, never acks.
+    void flushForwarded(bool wait) {
+        while (forward_fd_ != -1 && !forwarded_.empty()) {
+            ssize_t n = send(forward_fd_, forwarded_.data(), forwarded_.size(),
+                             MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+            if (n > 0) {
+                forwarded_.erase(0, n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (n < 0 && errno == EAGAIN) break;
+                forward_fd_ = -1;  // Client gone
+                forwarded_.clear();
+            }
+        }
+    }
+
+    std::string name_;
+    int fd_;
+    SerialLineReader& reader_;
+    LinePipeline& pipeline_;
+    AsyncLogger* log_;
+    ErrorPolicy policy_;
+    bool paused_ = false;          // Waiting for the operator after an error
+    uint64_t errors_skipped_ = 0;  // Lines answered with an error and passed over
+    std::vector<ValidationIssue> rejected_;
+    int rx_size_;
+    bool rx_verify_;
+    JobCheckpoint* checkpoint_;
+    int forward_fd_;
+    std::string forwarded_;        // Responses not yet sent to forward_fd_
+    bool planner_aware_;
+    int planner_size_;             // Planner blocks, the most ever reported free
+    uint32_t blocks_in_rx_ = 0;    // Planner blocks of the lines sent but not acknowledged
+    uint64_t dwell_pending_ms_ = 0;  // G4 dwells of the lines sent but not acknowledged
+    const LineIndex* index_;
+    bool label_;
+    SharedStatsSegment* shared_stats_;
+    Clock::time_point next_progress_;  // Zero without --progress
+    uint64_t first_line_ = 0;      // First source line sent
+    uint64_t last_acked_line_ = 0; // Last source line acknowledged
+    int available_;
+    int withheld_ = 0;             // Bytes held back after a drift correction
+    Clock::time_point idle_since_; // First idle, empty report while lines were pending
+    uint64_t drift_corrections_ = 0;
+    FixedRing<PendingLine, MAX_PENDING_LINES> pending_;
+    StreamStats stats_;
+    bool write_blocked_ = false;  // Last write hit EAGAIN, wait for POLLOUT
+    std::string realtime_;         // Real-time commands waiting for the port
+    char unsent_[MAX_LINE_LENGTH];  // Unwritten end of the last line sent
+    size_t unsent_len_ = 0;
+    size_t unsent_pos_ = 0;        // Bytes of unsent_ written since
+    bool halted_ = false;
+    bool completed_ = false;
+    bool finished_ = false;
+    GrblStatus status_;
+    Clock::time_point status_at_;  // When status_ arrived
+    Clock::duration status_interval_ = Clock::duration::zero();
+    Clock::time_point next_status_;
+    int return_code_ = 0;
+};
+
+// Unix socket that takes real-time commands while jobs run. Every client
+// may connect at any time and write raw command bytes, e.g.
+// printf '\x91' | nc -U <path> for +10% feed; other bytes are ignored.
+class ControlChannel {
+public:
+    ControlChannel() = default;
+    ControlChannel(const ControlChannel&) = delete;
+    ControlChannel& operator=(const ControlChannel&) = delete;
+
+    ~ControlChannel() {
+        for (int client : clients_) close(client);
+        if (listener_ != -1) {
+            close(listener_);
+            unlink(path_.c_str());
+        }
+    }
+
+    // Listen on path, replacing a stale socket. Returns false on error.
+    bool listen(const char* path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        strcpy(addr.sun_path, path);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+        listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener_ == -1) return false;
+        if (bind(listener_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listener_, 4) != 0) {
+            close(listener_);
+            listener_ = -1;
+            return false;
+        }
+        path_ = path;
+        return true;
+    }
+
+    int listenerFd() const { return listener_; }
+
+    // Accept a waiting client. Returns its descriptor, or -1.
+    int accept() {
+        int client = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client != -1) clients_.push_back(client);
+        return client;
+    }
+
+    // Read what a client sent into commands, keeping only real-time
+    // commands. Returns false once the client has gone; it is then closed.
+    bool read(int client, std::string& commands) {
+        char buf[256];
+        while (true) {
+            ssize_t n = recv(client, buf, sizeof(buf), 0);
+            if (n > 0) {
+                for (ssize_t i = 0; i < n; ++i) {
+                    if (isRealtimeCommand(static_cast<unsigned char>(buf[i]))) commands.push_back(buf[i]);
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) return true;
+            clients_.erase(std::find(clients_.begin(), clients_.end(), client));
+            close(client);
+            return false;
+        }
+    }
+
+private:
+    int listener_ = -1;
+    std::string path_;
+    std::vector<int> clients_;
+};
+
+// Runs any number of streamers from one thread with epoll. Each streamer
+// keeps its own flow-control state, so a slow controller only delays itself.
+class EventLoop {
+public:
+    EventLoop() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    ~EventLoop() { close(epoll_fd_); }
+
+    // Register a streamer; it must outlive run()
+    bool add(Streamer& streamer) {
+        entries_.push_back(std::make_unique<Entry>());
+        Entry& entry = *entries_.back();
+        entry.streamer = &streamer;
+        entry.port = {&streamer, TARGET_PORT, streamer.serialFd()};
+        entry.queue = {&streamer, TARGET_QUEUE, streamer.queueFd()};
+        struct epoll_event port_event = {EPOLLIN, {&entry.port}};
+        struct epoll_event queue_event = {EPOLLIN, {&entry.queue}};
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, streamer.serialFd(), &port_event) == 0 &&
+               epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, streamer.queueFd(), &queue_event) == 0;
+    }
+
+    // Pass the real-time commands of control's clients to every job; it
+    // must outlive run()
+    bool addControl(ControlChannel& control) {
+        control_ = &control;
+        control_listener_ = {nullptr, TARGET_CONTROL, control.listenerFd()};
+        struct epoll_event event = {EPOLLIN, {&control_listener_}};
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, control.listenerFd(), &event) == 0;
+    }
+
+    // Stream until every registered job has finished
+    void run() {
+        struct epoll_event events[64];
+        while (true) {
+            int timeout = -1;
+            size_t active = 0;
+            for (auto& entry : entries_) {
+                Streamer& streamer = *entry->streamer;
+                if (!entry->registered) continue;
+                int wait = streamer.finished() ? -1 : streamer.service();
+                if (streamer.finished()) {
+                    // Also for jobs stopped by an event handler
+                    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, streamer.serialFd(), nullptr);
+                    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, streamer.queueFd(), nullptr);
+                    entry->registered = false;
+                    continue;
+                }
+                ++active;
+                if (wait >= 0 && (timeout < 0 || wait < timeout)) timeout = wait;
+                if (streamer.wantsWrite() != entry->write_armed) {
+                    entry->write_armed = streamer.wantsWrite();
+                    struct epoll_event port_event = {EPOLLIN | (entry->write_armed ? EPOLLOUT : 0u), {&entry->port}};
+                    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, streamer.serialFd(), &port_event);
+                }
+            }
+            if (active == 0) return;
+
+            if (g_stats_requested) {
+                g_stats_requested = 0;
+                printSummaries(std::cerr);
+            }
+
+            int n = epoll_wait(epoll_fd_, events, 64, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                Target* target = static_cast<Target*>(events[i].data.ptr);
+                if (target->kind == TARGET_CONTROL) {
+                    onControl(*target);
+                    continue;
+                }
+                Streamer& streamer = *target->streamer;
+                if (streamer.finished()) continue;
+                ++streamer.stats().polls;
+                if (target->kind == TARGET_QUEUE) {
+                    streamer.onQueueEvent();
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) streamer.onWritable();
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) streamer.onReadable();
+            }
+        }
+    }
+
+    // Print every job's statistics, labelled when there is more than one
+    void printSummaries(std::ostream& out) {
+        for (auto& entry : entries_) {
+            if (entries_.size() > 1) out << "[" << entry->streamer->name() << "] ";
+            entry->streamer->stats().printSummary(out);
+            entry->streamer->printProgress(out);
+        }
+    }
+
+private:
+    enum TargetKind {
+        TARGET_PORT,     // A job's serial port
+        TARGET_QUEUE,    // A job's line queue event
+        TARGET_CONTROL,  // The control socket or one of its clients
+    };
+    struct Target {
+        Streamer* streamer;  // nullptr for control targets
+        TargetKind kind;
+        int fd;
+    };
+    struct Entry {
+        Streamer* streamer;
+        Target port;
+        Target queue;
+        bool write_armed = false;
+        bool registered = true;  // Its descriptors are in the epoll set
+    };
+
+    // Accept control clients, or forward what one sent to every running job
+    void onControl(Target& target) {
+        if (target.fd == control_->listenerFd()) {
+            int client;
+            while ((client = control_->accept()) != -1) {
+                control_clients_.push_back(std::make_unique<Target>(Target{nullptr, TARGET_CONTROL, client}));
+                struct epoll_event event = {EPOLLIN, {control_clients_.back().get()}};
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client, &event);
+            }
+            return;
+        }
+        std::string commands;
+        bool open = control_->read(target.fd, commands);
+        for (char command : commands) {
+            for (auto& entry : entries_) entry->streamer->sendRealtime(command);
+        }
+        if (!open) {
+            // Closing the client removed it from the epoll set
+            control_clients_.erase(std::find_if(control_clients_.begin(), control_clients_.end(),
+                                                [&target](const auto& client) { return client.get() == &target; }));
+        }
+    }
+
+    int epoll_fd_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+    ControlChannel* control_ = nullptr;
+    Target control_listener_ = {nullptr, TARGET_CONTROL, -1};
+    std::vector<std::unique_ptr<Target>> control_clients_;
+};
+
+// Buffer sizes reported by the controller (-1 where unknown)
+struct ControllerInfo {
+    int rx_buffer = -1;       // Usable RX buffer bytes
+    int planner_blocks = -1;  // Planner buffer blocks
+};
+
+// Function to ask GRBL for its buffer sizes. Tries the $I build info
+// ("[OPT:V,15,128]": options, planner blocks, RX bytes) first and falls back
+// to the Bf: field of a status report, which is exact while idle.
+// Returns false if neither reported an RX size.
+bool detectBufferSizes(SerialLineReader& reader, int fd, ControllerInfo& info) {
+    std::string_view line;
+    if (serialWrite(fd, "$I\n", 3) == 3) {
+        while (readSerialLine(reader, fd, line, 1000)) {
+            line = trimWhitespace(line);
+            if (line.substr(0, 5) == "[OPT:" && line.back() == ']') {
+                std::string_view fields = line.substr(5, line.size() - 6);
+                size_t comma = fields.find(',');
+                double numbers[2];
+                if (comma != std::string_view::npos &&
+                    parseStatusNumbers(fields.substr(comma + 1), numbers, 2) == 2) {
+                    info.planner_blocks = static_cast<int>(numbers[0]);
+                    info.rx_buffer = static_cast<int>(numbers[1]) - 1;  // One byte of the ring stays empty
+                }
+            }
+            ResponseKind kind = classifyResponse(line).kind;
+            if (kind == RESPONSE_OK || kind == RESPONSE_ERROR) break;
+        }
+    }
+    if (info.rx_buffer > 0) return true;
+
+    if (serialWrite(fd, "?", 1) == 1) {
+        GrblStatus status;
+        while (readSerialLine(reader, fd, line, 1000)) {
+            if (parseStatusReport(trimWhitespace(line), status)) {
+                if (status.rx_free > 0) info.rx_buffer = status.rx_free - 1;
+                if (status.planner_free > 0) info.planner_blocks = status.planner_free;
+                break;
+            }
+        }
+    }
+    return info.rx_buffer > 0;
+}
+
+const int HANDSHAKE_TIMEOUT_MS = 2000;  // Longest wait for a controller to show up
+const int HANDSHAKE_QUIET_MS = 50;     // Silence that ends the replies to the wakeup
+const int HANDSHAKE_PROBE_MS = 100;    // Status probe interval when attaching
+
+// Function to wait until the controller is ready to stream. With reset, the
+// wakeup has been sent and GRBL is ready once its "Grbl x.y" banner arrives,
+// or once it has answered the wakeup if the port did not reset it; either way
+// the replies are read until the line goes quiet, since wakeup bytes that
+// reached it after a reset are still answered and must not be taken as acks.
+// Without reset, '?' probes are sent until a status report comes back. The
+// line that confirmed the controller goes to reply. Returns false on timeout.
+bool waitForController(SerialLineReader& reader, int fd, bool reset,
+                       std::chrono::steady_clock::time_point deadline, std::string& reply) {
+    using Clock = std::chrono::steady_clock;
+    bool answered = false;  // The wakeup got an "ok"; wait for the rest to drain
+    Clock::time_point next_probe = Clock::now();
+    while (true) {
+        Clock::time_point now = Clock::now();
+        if (now >= deadline) return answered;
+        if (!reset && now >= next_probe) {
+            serialWrite(fd, "?", 1);
+            next_probe = now + std::chrono::milliseconds(HANDSHAKE_PROBE_MS);
+        }
+        Clock::time_point wake = reset ? deadline : std::min(deadline, next_probe);
+        int timeout_ms = static_cast<int>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count()) + 1;
+        if (answered) timeout_ms = std::min(timeout_ms, HANDSHAKE_QUIET_MS);
+
+        std::string_view line;
+        if (!readSerialLine(reader, fd, line, timeout_ms)) {
+            if (answered) return true;
+            continue;
+        }
+        line = trimWhitespace(line);
+        ResponseKind kind = classifyResponse(line).kind;
+        if (kind == RESPONSE_BANNER) {
+            // Printed after a reset, which discarded anything sent before it
+            reply.assign(line);
+            if (!reset) return true;
+            answered = true;
+        }
+        if (!reset && kind == RESPONSE_STATUS) {
+            reply.assign(line);
+            return true;
+        }
+        if (reset && kind == RESPONSE_OK && !answered) {
+            reply.assign(line);
+            answered = true;
+        }
+    }
+}
+
+// Longest wait for the answers to lines left in the controller by a job that
+// stopped early
+const int DRAIN_TIMEOUT_MS = 2000;
+
+// Function to read and discard the answers to count lines still buffered in
+// the controller, so the next job on the port does not take them as acks.
+// Returns false if they did not all arrive in time.
+bool drainAnswers(SerialLineReader& reader, int fd, size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+    while (count > 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        std::string_view line;
+        if (left.count() <= 0 || !readSerialLine(reader, fd, line, static_cast<int>(left.count()))) return false;
+        ResponseKind kind = classifyResponse(trimWhitespace(line)).kind;
+        if (kind == RESPONSE_OK || kind == RESPONSE_ERROR) --count;
+    }
+    return true;
+}
+
+// Function to switch GRBL's check mode ($C) on or off. $C toggles it, so
+// the [MSG:Enabled] or [MSG:Disabled] that comes back tells which way it
+// went, and a second $C corrects a controller that was already in it.
+// Leaving check mode makes GRBL reset itself; its banner is waited for.
+// Returns false if the controller refused (it only enters check mode while
+// idle) or did not answer.
+bool setCheckMode(SerialLineReader& reader, int fd, bool enable) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (serialWrite(fd, "$C\n", 3) != 3) return false;
+        int enabled = -1;
+        std::string_view line;
+        while (true) {
+            if (!readSerialLine(reader, fd, line, DRAIN_TIMEOUT_MS)) return false;
+            line = trimWhitespace(line);
+            if (line == "[MSG:Enabled]") enabled = 1;
+            if (line == "[MSG:Disabled]") enabled = 0;
+            ResponseKind kind = classifyResponse(line).kind;
+            if (kind == RESPONSE_ERROR) return false;
+            if (kind == RESPONSE_OK) break;
+        }
+        if (enabled == -1) return false;
+        if (enabled == 0) {
+            do {
+                if (!readSerialLine(reader, fd, line, DRAIN_TIMEOUT_MS)) return false;
+            } while (classifyResponse(trimWhitespace(line)).kind != RESPONSE_BANNER);
+        }
+        if ((enabled == 1) == enable) return true;
+    }
+    return false;
+}
+
+// Command-line settings shared by every job
+struct Settings {
+    int baud = 115200;  // Default baudrate as int
+    bool verbose = false;
+    bool compact = false;
+    int compact_precision = DEFAULT_COMPACT_PRECISION;
+    double coalesce_tolerance = 0;  // Largest path deviation when merging segments, 0 for off
+    bool arc_fit = true;
+    unsigned clean_flags = CLEAN_DEFAULT;  // How lines are cleaned before sending
+    bool detect_rx_buffer = false;
+    const char* stats_file_path = nullptr;
+    const char* log_file_path = nullptr;  // Per-line log goes here instead of stdout
+    bool shm_stats = false;  // Publish live statistics in shared memory
+    const char* trace_path = nullptr;  // Record the raw serial traffic here
+    const char* checkpoint_path = nullptr;
+    bool resume = false;
+    bool reset = true;  // Wake up the controller and wait for it to start
+    bool low_latency = true;
+    int handshake_timeout_ms = HANDSHAKE_TIMEOUT_MS;
+    const char* serve = nullptr;  // Listen address in bridge mode
+    const char* batch = nullptr;  // List file or spool directory of a batch
+    const char* control_path = nullptr;  // Unix socket for real-time commands
+    bool validate = false;  // Check the whole file before streaming it
+    bool check = false;     // Stream through GRBL's check mode ($C) to verify the job
+    double rapid_rate = DEFAULT_RAPID_RATE;
+    uint64_t start_line = 0;  // Source line to start streaming at, 0 for the first
+    StreamOptions stream;
+};
+
+// One serial port and the G-code file streamed to it
+struct Job {
+    std::string device;
+    std::string gcode_path;
+    int fd = -1;
+    std::unique_ptr<SerialLineReader> reader;
+    GcodeIngest ingest;
+    GcodeCompactor compactor{DEFAULT_COMPACT_PRECISION};
+    std::unique_ptr<SegmentCoalescer> coalescer;
+    std::unique_ptr<TimeEstimator> block_counter;  // Planner blocks per line in planner-aware mode
+    std::unique_ptr<JobCheckpoint> checkpoint;
+    std::unique_ptr<SharedStatsSegment> shared_stats;
+    LineIndex index;
+    PipelineConfig pipeline_config;
+    LinePipeline pipeline;
+    std::unique_ptr<Streamer> streamer;
+
+    ~Job() {
+        pipeline.stop();
+        if (fd != -1) close(fd);
+    }
+};
+
+// Function to open and configure a serial port. Returns the fd or -1.
+int openSerialPort(const char* serial_device, int baud_int, bool low_latency, bool verbose) {
+    if (verbose) {
+        std::cout << "Opening serial port: " << serial_device << std::endl;
+    }
+    // Open the serial port non-blocking
+    int fd = open(serial_device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        std::cerr << "Error opening serial port: " << serial_device << std::endl;
+        return -1;
+    }
+    if (verbose) {
+        std::cout << "Serial port opened successfully." << std::endl;
+        std::cout << "Configuring serial port at baudrate: " << baud_int << std::endl;
+    }
+
+    // Get speed_t from int; rates without a constant are set afterwards
+    speed_t baudrate = get_baudrate(baud_int);
+
+    // Configure the serial port. The speed lives in c_cflag, so set it last.
+    struct termios options;
+    memset(&options, 0, sizeof(options));
+    tcgetattr(fd, &options);
+    options.c_cflag = (CLOCAL | CREAD | CS8);  // 8N1, no parity, 1 stop bit
+    cfsetispeed(&options, baudrate == B0 ? B38400 : baudrate);
+    cfsetospeed(&options, baudrate == B0 ? B38400 : baudrate);
+    options.c_iflag = IGNPAR;                  // Ignore parity errors
+    options.c_oflag = 0;
+    options.c_lflag = 0;                       // Non-canonical mode
+    options.c_cc[VTIME] = 0;                   // No timeout
+    options.c_cc[VMIN] = 1;                    // Read at least 1 char
+    tcflush(fd, TCIFLUSH);
+    if (tcsetattr(fd, TCSANOW, &options) != 0) {
+        std::cerr << "Error setting serial attributes." << std::endl;
+        close(fd);
+        return -1;
+    }
+    if (baudrate == B0) {
+        int actual = setCustomBaudrate(fd, baud_int);
+        if (actual == -1) {
+            std::cerr << "Unsupported baudrate: " << baud_int << std::endl;
+            close(fd);
+            return -1;
+        }
+        // UARTs tolerate a few percent of clock error
+        if (std::abs(actual - baud_int) > baud_int / 50) {
+            std::cerr << "Warning: " << serial_device << " runs at " << actual << " baud instead of " << baud_int
+                      << "." << std::endl;
+        }
+    }
+    if (low_latency) {
+        setLowLatency(fd, serial_device, verbose);
+    }
+    if (verbose) {
+        std::cout << "Serial port configured successfully." << std::endl;
+    }
+    return fd;
+}
+
+// Interval of the lines printed by --watch
+const std::chrono::seconds WATCH_INTERVAL{1};
+
+// Function to print the live statistics a streamer with --shm-stats
+// publishes for device, once a second until that process exits
+int watchStats(const char* device) {
+    std::string name = SharedStatsSegment::nameFor(device);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) {
+        std::cerr << "Error: no statistics for " << device << " (" << name << "); is a streamer running with --shm-stats?"
+                  << std::endl;
+        return 1;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SharedStats)) {
+        map = mmap(nullptr, sizeof(SharedStats), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error mapping " << name << std::endl;
+        return 1;
+    }
+    const SharedStats& shared = *static_cast<const SharedStats*>(map);
+    if (memcmp(shared.magic, "GSSTATS", 8) != 0 || shared.version != SHARED_STATS_VERSION ||
+        shared.size != sizeof(SharedStats)) {
+        std::cerr << "Error: " << name << " was written by a different version of the streamer." << std::endl;
+        munmap(map, sizeof(SharedStats));
+        return 1;
+    }
+
+    SharedStats::Values previous = {};
+    while (true) {
+        bool running = kill(shared.pid, 0) == 0 || errno == EPERM;  // The last values stay readable after it
+        SharedStats::Values values;
+        SharedStatsSegment::read(shared, values);
+        // Rate since the previous line, or since the start of a new job
+        bool same_job = previous.started_ns == values.started_ns;
+        uint64_t since_ns = same_job ? previous.updated_ns : values.started_ns;
+        uint64_t bytes = values.bytes_sent - (same_job ? previous.bytes_sent : 0);
+        double seconds = values.updated_ns > since_ns ? (values.updated_ns - since_ns) / 1e9 : 0;
+        if (!same_job || values.updated_ns != previous.updated_ns || previous.exit_code != values.exit_code) {
+            std::cout << (values.state[0] != '\0' ? values.state : "-") << " line " << values.last_line << ", "
+                      << values.lines_acked << "/" << values.lines_sent << " lines acked, "
+                      << static_cast<uint64_t>(seconds > 0 ? bytes / seconds : 0) << " bytes/s, RX " << values.rx_used
+                      << "/" << values.rx_size << ", " << values.pending << " pending";
+            if (values.planner_free >= 0) std::cout << ", planner " << values.planner_free << " free";
+            if (values.errors_skipped > 0) std::cout << ", " << values.errors_skipped << " skipped";
+            if (values.exit_code >= 0) std::cout << ", finished with exit code " << values.exit_code;
+            std::cout << std::endl;
+        }
+        if (!running) break;
+        previous = values;
+        std::this_thread::sleep_for(WATCH_INTERVAL);
+    }
+    munmap(map, sizeof(SharedStats));
+    return 0;
+}
+
+// Function to validate a G-code file and print the report. Returns false if
+// it cannot be streamed as it is.
+bool validateJob(const char* gcode_file_path, const Settings& settings) {
+    ValidationReport report;
+    if (!validateGcode(gcode_file_path, settings.stream.rx_buffer, settings.rapid_rate, settings.clean_flags,
+                       report)) {
+        std::cerr << "Error opening G-code file: " << gcode_file_path << std::endl;
+        return false;
+    }
+    report.print(std::cout, gcode_file_path);
+    return report.issue_count == 0;
+}
+
+// Function to open a job's G-code file and set up checkpointing and resume.
+// Returns false (after printing why) if the job cannot run.
+bool loadJob(Job& job, const Settings& settings) {
+    const char* gcode_file_path = job.gcode_path.c_str();
+    if (isSocketInput(gcode_file_path)) {
+        std::cout << "Waiting for G-code on " << gcode_file_path << "..." << std::endl;
+    } else if (settings.verbose) {
+        std::cout << "Opening G-code file: " << gcode_file_path << std::endl;
+    }
+    if (!job.ingest.open(gcode_file_path)) {
+        std::cerr << "Error opening G-code file: " << gcode_file_path
+                  << (job.ingest.error() != nullptr ? std::string(": ") + job.ingest.error() : "") << std::endl;
+        return false;
+    }
+    job.ingest.setCleaning(settings.clean_flags);
+    if (settings.verbose) {
+        std::cout << "G-code file opened successfully." << std::endl;
+    }
+    struct stat st;
+    if (settings.validate && (stat(gcode_file_path, &st) != 0 || !S_ISREG(st.st_mode))) {
+        // Validating would consume the input the job has to stream
+        std::cerr << "Error: --validate before streaming needs a G-code file, not a stream." << std::endl;
+        return false;
+    }
+    if (settings.validate && !validateJob(gcode_file_path, settings)) {
+        std::cerr << "Not streaming " << gcode_file_path << "." << std::endl;
+        return false;
+    }
+
+    job.compactor = GcodeCompactor(settings.compact_precision);
+    job.pipeline_config.compactor = settings.compact ? &job.compactor : nullptr;
+    if (settings.coalesce_tolerance > 0) {
+        job.coalescer = std::make_unique<SegmentCoalescer>(settings.coalesce_tolerance, settings.arc_fit);
+        job.pipeline_config.coalescer = job.coalescer.get();
+    }
+    if (settings.stream.planner_aware) {
+        job.block_counter = std::make_unique<TimeEstimator>(settings.rapid_rate);
+        job.pipeline_config.block_counter = job.block_counter.get();
+    }
+
+    // Progress and --start-line look lines up in the index
+    if (settings.stream.progress || settings.start_line > 0) {
+        if (job.ingest.mapped().empty()) {
+            if (settings.start_line > 0) {
+                std::cerr << "Error: --start-line needs an uncompressed G-code file." << std::endl;
+                return false;
+            }
+            std::cerr << "No progress for " << gcode_file_path << ": only uncompressed files can be indexed."
+                      << std::endl;
+        } else if (!job.index.open(gcode_file_path, job.ingest.mapped(), settings.rapid_rate, settings.clean_flags,
+                                   settings.verbose)) {
+            std::cerr << "Error indexing " << gcode_file_path << ": "
+                      << (job.index.error() != nullptr ? job.index.error() : strerror(errno)) << std::endl;
+            return false;
+        }
+    }
+    if (settings.start_line > 0) {
+        if (settings.start_line > job.index.lines()) {
+            std::cerr << "Error: " << gcode_file_path << " has only " << job.index.lines() << " lines." << std::endl;
+            return false;
+        }
+        // The lines before the start still set the modal state
+        uint64_t offset = job.index.offset(settings.start_line);
+        GcodeIngest before;
+        before.attach(job.ingest.mapped().substr(0, offset), 0);
+        before.setCleaning(settings.clean_flags);
+        GcodeLine line;
+        while (before.next(line)) job.pipeline_config.modal.apply(line.text);
+        job.pipeline_config.preamble = job.pipeline_config.modal.preamble();
+        job.pipeline_config.motion = job.pipeline_config.modal.motionWord();
+        job.ingest.seek(offset, settings.start_line);
+        std::cout << "Starting " << gcode_file_path << " at line " << settings.start_line
+                  << ". The machine continues from its current position." << std::endl;
+        if (settings.verbose) {
+            for (const std::string& text : job.pipeline_config.preamble) {
+                std::cout << "Restoring modal state: " << text << std::endl;
+            }
+            if (!job.pipeline_config.motion.empty()) {
+                std::cout << "Restoring motion mode on the first move: " << job.pipeline_config.motion << std::endl;
+            }
+        }
+    }
+
+    // Checkpointing is on with --checkpoint, and --resume implies it
+    std::string checkpoint_path = (settings.checkpoint_path != nullptr) ? settings.checkpoint_path
+                                                                       : job.gcode_path + ".checkpoint";
+    if (settings.checkpoint_path == nullptr && !settings.resume) return true;
+    job.checkpoint = std::make_unique<JobCheckpoint>(checkpoint_path.c_str());
+    if (!job.checkpoint->identify(gcode_file_path)) {
+        std::cerr << "Error: checkpointing needs a regular G-code file." << std::endl;
+        return false;
+    }
+    job.pipeline_config.track_modal = true;
+    if (!settings.resume) {
+        if (settings.start_line > 1) {
+            uint64_t before = settings.start_line - 1;
+            job.checkpoint->record(before, job.index.offset(before), job.pipeline_config.modal);
+        }
+        return true;
+    }
+
+    JobCheckpoint saved(checkpoint_path.c_str());
+    if (!saved.load()) {
+        std::cerr << "Error: no checkpoint to resume from in " << checkpoint_path << std::endl;
+        return false;
+    }
+    if (saved.file_size != job.checkpoint->file_size || saved.file_mtime != job.checkpoint->file_mtime) {
+        std::cerr << "Error: " << gcode_file_path << " has changed since the checkpoint was written." << std::endl;
+        return false;
+    }
+
+    // Continue after the last acknowledged line, restoring its modal state first
+    if (job.ingest.mapped().empty()) {
+        std::cerr << "Error: resuming needs an uncompressed G-code file." << std::endl;
+        return false;
+    }
+    GcodeLine acked;
+    if (!job.ingest.seek(saved.offset, saved.line_number) || !job.ingest.next(acked)) {
+        std::cerr << "Error: checkpoint does not match " << gcode_file_path << std::endl;
+        return false;
     }
-    return B0;  // Unreachable
+    job.pipeline_config.modal = saved.modal;
+    job.pipeline_config.preamble = saved.modal.preamble();
+    job.pipeline_config.motion = saved.modal.motionWord();
+    job.checkpoint->record(saved.line_number, saved.offset, saved.modal);
+    std::cout << "Resuming " << gcode_file_path << " after line " << saved.line_number
+              << ". The machine continues from its current position." << std::endl;
+    if (settings.verbose) {
+        for (const std::string& line : job.pipeline_config.preamble) {
+            std::cout << "Restoring modal state: " << line << std::endl;
+        }
+        if (!job.pipeline_config.motion.empty()) {
+            std::cout << "Restoring motion mode on the first move: " << job.pipeline_config.motion << std::endl;
+        }
+    }
+    return true;
 }
 
-// Function to read a line from the serial port (until \n) using polling with select
-// For indefinite wait, timeout is NULL
-std::string readSerialLine(int fd, bool verbose) {
-    std::string line;
+// Function to detect the controller's buffers if requested and start the
+// job's pipeline and streamer once its handshake is done
+void startJob(Job& job, const Settings& settings) {
+    SerialLineReader& reader = *job.reader;
+    int fd = job.fd;
+
+    StreamOptions stream_options = settings.stream;
+    if (settings.detect_rx_buffer) {
+        ControllerInfo info;
+        if (detectBufferSizes(reader, fd, info)) {
+            stream_options.rx_buffer = std::min(info.rx_buffer, MAX_RX_BUFFER_SIZE);
+            stream_options.planner_blocks = std::max(info.planner_blocks, 0);
+            if (settings.verbose) {
+                std::cout << "Detected RX buffer: " << info.rx_buffer << " bytes, planner: "
+                          << info.planner_blocks << " blocks" << std::endl;
+            }
+        } else {
+            std::cerr << "Could not detect the RX buffer size, using " << stream_options.rx_buffer
+                      << " bytes." << std::endl;
+        }
+    }
+
+    if (job.index.lines() > 0) stream_options.index = &job.index;
+
+    // The planner fill is only known from status reports
+    if (stream_options.planner_aware && stream_options.status_hz <= 0) stream_options.status_hz = PLANNER_STATUS_HZ;
+
+    // Parse on a background thread while the event loop drives the serial
+    // port; a batch job's parser may already be running ahead
+    if (!job.pipeline.started()) job.pipeline.start(job.ingest, job.pipeline_config);
+    stream_options.checkpoint = job.checkpoint.get();
+    stream_options.shared_stats = job.shared_stats.get();
+    if (settings.serve != nullptr) stream_options.forward_fd = job.ingest.fd();
+    job.streamer = std::make_unique<Streamer>(job.device, fd, reader, job.pipeline, stream_options);
+}
+
+// Function to report a finished job and write its checkpoint and statistics
+void finishJob(Job& job, const Settings& settings, bool label) {
+    Streamer& streamer = *job.streamer;
+    job.pipeline.stop();
+    std::string prefix = label ? "[" + job.device + "] " : "";
+    if (job.checkpoint != nullptr) {
+        if (streamer.completed()) {
+            job.checkpoint->remove();
+        } else if (job.checkpoint->save()) {
+            std::cerr << prefix << "Progress saved to " << job.checkpoint->path() << "; continue with --resume."
+                      << std::endl;
+        }
+    }
+    std::cout << prefix;
+    streamer.stats().printSummary(std::cout);
+    if (settings.stats_file_path != nullptr) {
+        // Several jobs get one file each, named after their device
+        std::string path = settings.stats_file_path;
+        if (label) {
+            size_t dot = path.rfind('.');
+            size_t slash = path.rfind('/');
+            if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+            std::string device = job.device.substr(job.device.rfind('/') + 1);
+            path.insert(dot, "." + device);
+        }
+        if (!streamer.stats().writeFile(path.c_str())) {
+            std::cerr << "Error writing statistics file: " << path << std::endl;
+        }
+    }
+
+    if (settings.check) {
+        // Leave check mode; lines answered after a halt come first
+        if (!drainAnswers(*job.reader, job.fd, streamer.pendingLines()) || !setCheckMode(*job.reader, job.fd, false)) {
+            std::cerr << prefix << "Could not leave check mode; reset the controller before running a job." << std::endl;
+        }
+        const StreamStats& stats = streamer.stats();
+        double seconds = stats.elapsedSeconds();
+        std::cout << prefix << "Check mode verified " << stats.linesSent() << " lines in " << seconds << " s ("
+                  << (seconds > 0 ? stats.linesSent() / seconds : 0) << " lines/s)";
+        if (!streamer.completed()) std::cout << ", stopped before the end";
+        std::cout << "\n";
+        if (streamer.errorsSkipped() == 0) {
+            std::cout << prefix << "GRBL accepted every line." << std::endl;
+        } else {
+            std::cout << prefix << streamer.errorsSkipped() << " line" << (streamer.errorsSkipped() == 1 ? "" : "s")
+                      << " rejected:\n";
+            for (const ValidationIssue& issue : streamer.rejectedLines()) {
+                std::cout << prefix << "  line " << issue.line_number << ": " << issue.what << "\n";
+            }
+            if (streamer.errorsSkipped() > streamer.rejectedLines().size()) std::cout << prefix << "  ...\n";
+            std::cout.flush();
+        }
+    } else if (streamer.errorsSkipped() > 0) {
+        std::cout << prefix << streamer.errorsSkipped() << " line" << (streamer.errorsSkipped() == 1 ? " was" : "s were")
+                  << " skipped after GRBL errors." << std::endl;
+    }
+    if (settings.verbose) {
+        if (streamer.completed()) {
+            std::cout << prefix << "Streaming completed successfully." << std::endl;
+        } else {
+            std::cout << prefix << "Streaming halted due to error." << std::endl;
+        }
+    }
+
+    if (job.coalescer != nullptr && job.coalescer->linesIn() > 0) {
+        const SegmentCoalescer& coalescer = *job.coalescer;
+        std::cout << prefix << "Coalescing sent " << coalescer.linesOut() << " of " << coalescer.linesIn()
+                  << " lines (" << coalescer.arcs() << " arcs), " << coalescer.bytesOut() << " of "
+                  << coalescer.bytesIn() << " bytes ("
+                  << (100.0 * (coalescer.bytesIn() - coalescer.bytesOut()) / coalescer.bytesIn()) << "% saved)"
+                  << std::endl;
+    }
+    if (settings.compact && job.compactor.bytesIn() > 0) {
+        uint64_t saved = job.compactor.bytesIn() - job.compactor.bytesOut();
+        std::cout << prefix << "Compaction saved " << saved << " of " << job.compactor.bytesIn() << " bytes ("
+                  << (100.0 * saved / job.compactor.bytesIn()) << "%)" << std::endl;
+    }
+}
+
+// Function to let a bridge client read the last responses before its
+// connection closes. Closing a socket with unread input resets it, which
+// can discard them, so input is drained until the client closes too.
+void lingerClient(int fd) {
+    shutdown(fd, SHUT_WR);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+    char scratch[4096];
+    while (std::chrono::steady_clock::now() < deadline) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) return;
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) <= 0) return;
+    }
+}
+
+// Function to run as a network bridge: stream the G-code of one client at a
+// time to the port and send every controller response back to it. Flow
+// control stays local, so network latency never delays an ack. Returns only
+// when a client cannot be accepted.
+int serveClients(Job& port, const Settings& settings, ControlChannel* control) {
     while (true) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
+        Job session;
+        session.device = port.device;
+        session.gcode_path = port.gcode_path;
+        if (!loadJob(session, settings)) return 1;
+        std::cout << "Client connected." << std::endl;
+        std::swap(session.fd, port.fd);
+        std::swap(session.reader, port.reader);
+        std::swap(session.shared_stats, port.shared_stats);
 
-        // Indefinite timeout (wait forever)
-        int retval = select(fd + 1, &rfds, nullptr, nullptr, nullptr);
-        if (retval == -1) {
-            perror("select");
+        startJob(session, settings);
+        EventLoop loop;
+        if (!loop.add(*session.streamer) || (control != nullptr && !loop.addControl(*control))) {
+            perror("epoll_ctl");
+            return 1;
+        }
+        loop.run();
+        finishJob(session, settings, false);
+        if (!drainAnswers(*session.reader, session.fd, session.streamer->pendingLines())) {
+            std::cerr << "Warning: the controller did not answer every line sent." << std::endl;
+        }
+        lingerClient(session.ingest.fd());
+        std::cout << "Client disconnected." << std::endl;
+        std::swap(session.fd, port.fd);
+        std::swap(session.reader, port.reader);
+        std::swap(session.shared_stats, port.shared_stats);
+    }
+}
+
+// Files of a batch in the order they are run: the lines of a list file
+// (blank lines and # comments skipped), or the files of a spool directory
+// in name order. A directory is read again each time the files found so
+// far have run, so files added meanwhile join the batch.
+class BatchQueue {
+public:
+    bool open(const char* path) {
+        struct stat st;
+        if (stat(path, &st) != 0) return false;
+        if (S_ISDIR(st.st_mode)) {
+            spool_ = path;
+            return true;
+        }
+        FILE* list = fopen(path, "r");
+        if (list == nullptr) return false;
+        char buf[PATH_MAX];
+        while (fgets(buf, sizeof(buf), list) != nullptr) {
+            std::string_view line = trimWhitespace(buf);
+            if (!line.empty() && line[0] != '#') files_.emplace_back(line);
+        }
+        fclose(list);
+        return true;
+    }
+
+    // Next file to run. Returns false once the batch is done.
+    bool next(std::string& path) {
+        if (pos_ == files_.size() && !spool_.empty()) rescan();
+        if (pos_ == files_.size()) return false;
+        path = files_[pos_++];
+        return true;
+    }
+
+private:
+    // Add the spool's files that have not been seen yet. Hidden files and
+    // what the streamer writes next to a job (.idx, .checkpoint) are skipped.
+    void rescan() {
+        DIR* dir = opendir(spool_.c_str());
+        if (dir == nullptr) return;
+        std::vector<std::string> found;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string_view name = entry->d_name;
+            auto ends_with = [&](std::string_view suffix) {
+                return name.size() >= suffix.size() && name.substr(name.size() - suffix.size()) == suffix;
+            };
+            if (name[0] == '.' || ends_with(".idx") || ends_with(".checkpoint")) continue;
+            std::string path = spool_ + "/" + std::string(name);
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (std::find(files_.begin(), files_.end(), path) == files_.end()) found.push_back(path);
+        }
+        closedir(dir);
+        std::sort(found.begin(), found.end());
+        files_.insert(files_.end(), found.begin(), found.end());
+    }
+
+    std::string spool_;  // Directory to scan, empty for a list
+    std::vector<std::string> files_;
+    size_t pos_ = 0;
+};
+
+const int IDLE_POLL_MS = 20;  // Status query interval while waiting for Idle
+const int IDLE_ANSWER_MS = 1000;  // Longest wait for the answer to one query
+
+// Function to wait until GRBL has run everything it buffered and reports
+// Idle. Returns false on an alarm or if the controller stops answering.
+bool waitForIdle(SerialLineReader& reader, int fd) {
+    while (true) {
+        if (serialWrite(fd, "?", 1) != 1) return false;
+        GrblStatus status;
+        std::string_view line;
+        do {
+            if (!readSerialLine(reader, fd, line, IDLE_ANSWER_MS)) return false;
+            line = trimWhitespace(line);
+            if (classifyResponse(line).kind == RESPONSE_ALARM) return false;
+        } while (!parseStatusReport(line, status));
+        if (strcmp(status.state, "Idle") == 0) return true;
+        if (strncmp(status.state, "Alarm", 5) == 0) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_POLL_MS));
+    }
+}
+
+// Function to run the files of a batch one after another over the port's
+// one connection. While a job streams, the next file is loaded, indexed and
+// parsed ahead on a background thread; it starts once GRBL reports Idle.
+// The batch stops at the first job that fails.
+int runBatch(Job& port, const Settings& settings, ControlChannel* control) {
+    using Clock = std::chrono::steady_clock;
+    BatchQueue queue;
+    if (!queue.open(settings.batch)) {
+        std::cerr << "Error opening batch " << settings.batch << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    auto load = [&](const std::string& path, std::unique_ptr<Job>& job) {
+        job = std::make_unique<Job>();
+        job->device = port.device;
+        job->gcode_path = path;
+        if (!loadJob(*job, settings)) return false;
+        job->pipeline.start(job->ingest, job->pipeline_config);
+        return true;
+    };
+
+    std::string path;
+    if (!queue.next(path)) {
+        std::cerr << "Error: no G-code files in " << settings.batch << std::endl;
+        return 1;
+    }
+    std::unique_ptr<Job> job;
+    bool loaded = load(path, job);
+    int return_code = 0;
+    int count = 0;
+    Clock::time_point batch_start = Clock::now();
+    Clock::time_point idle_at;         // When GRBL went idle after the previous job
+    Clock::duration host_gap = Clock::duration::zero();  // Idle until the next job streamed, summed
+    Clock::duration idle_wait = Clock::duration::zero();
+    while (job != nullptr) {
+        if (!loaded) {
+            if (count > 0) std::cerr << "Stopping the batch: " << job->gcode_path << " could not be loaded." << std::endl;
+            return_code = 1;
             break;
-        } else if (retval == 0) {
-            // Should not happen with NULL timeout
+        }
+        ++count;
+        std::cout << "Job " << count << ": " << job->gcode_path << std::endl;
+        std::swap(job->fd, port.fd);
+        std::swap(job->reader, port.reader);
+        std::swap(job->shared_stats, port.shared_stats);
+        if (settings.check && !setCheckMode(*job->reader, job->fd, true)) {
+            std::cerr << "Error: " << job->device << " did not enter check mode; it must be idle." << std::endl;
+            return 1;
+        }
+        startJob(*job, settings);
+        EventLoop loop;
+        if (!loop.add(*job->streamer) || (control != nullptr && !loop.addControl(*control))) {
+            perror("epoll_ctl");
+            return 1;
+        }
+        if (count > 1) host_gap += Clock::now() - idle_at;
+
+        // Load the next file while this one streams
+        std::unique_ptr<Job> next;
+        bool next_loaded = false;
+        std::thread loader;
+        if (queue.next(path)) loader = std::thread([&, path] { next_loaded = load(path, next); });
+        loop.run();
+        if (loader.joinable()) loader.join();
+
+        finishJob(*job, settings, false);
+        // In check mode finishJob drained them before leaving $C
+        if (!settings.check && !drainAnswers(*job->reader, job->fd, job->streamer->pendingLines())) {
+            std::cerr << "Warning: the controller did not answer every line sent." << std::endl;
+        }
+        int job_code = job->streamer->exitCode();
+        if (settings.check && job_code == EXIT_ERRORS_SKIPPED) job_code = EXIT_GRBL_ERROR;
+        std::swap(job->fd, port.fd);
+        std::swap(job->reader, port.reader);
+        std::swap(job->shared_stats, port.shared_stats);
+        if (job_code != 0 && job_code != EXIT_ERRORS_SKIPPED) {
+            return_code = job_code;
             break;
-        } else {
-            if (FD_ISSET(fd, &rfds)) {
-                char buf;
-                int n = read(fd, &buf, 1);
-                if (n > 0) {
-                    line += buf;
-                    if (buf == '\n') {
-                        break;
-                    }
-                } else if (n == 0) {
-                    // EOF
-                    break;
-                } else {
-                    perror("read");
-                    break;
-                }
+        }
+        if (return_code == 0) return_code = job_code;
+
+        // A spool directory may have got new files while the job ran
+        if (next == nullptr && queue.next(path)) next_loaded = load(path, next);
+        if (next != nullptr) {
+            Clock::time_point done = Clock::now();
+            if (!waitForIdle(*port.reader, port.fd)) {
+                std::cerr << "Error: " << port.device << " did not return to Idle; stopping the batch." << std::endl;
+                return_code = EXIT_GRBL_ALARM;
+                break;
             }
+            idle_at = Clock::now();
+            idle_wait += idle_at - done;
         }
+        job = std::move(next);
+        loaded = next_loaded;
     }
-    return line;
+
+    double seconds = std::chrono::duration<double>(Clock::now() - batch_start).count();
+    std::cout << "Batch: " << count << " job" << (count == 1 ? "" : "s") << " in " << formatDuration(seconds);
+    if (count > 1) {
+        std::cout << ", " << std::chrono::duration<double, std::milli>(host_gap).count() / (count - 1)
+                  << " ms from Idle to the next job on average (waited "
+                  << std::chrono::duration<double>(idle_wait).count() << " s for Idle)";
+    }
+    std::cout << std::endl;
+    return return_code;
 }
 
 // Function to print help
@@ -87,44 +5173,250 @@ void printHelp(const char* progName) {
     std::cout << "Usage: " << progName << " [options]" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -S, --serial <device>    Serial device (e.g., /dev/ttyUSB0)" << std::endl;
-    std::cout << "  -f, --file <gcode>       G-code file to stream" << std::endl;
-    std::cout << "  -b, --baud <rate>        Baudrate (default: 115200)" << std::endl;
+    std::cout << "  -S <device>:<gcode>      Stream gcode to device; repeat to run several machines" << std::endl;
+    std::cout << "  -f, --file <gcode>       G-code file to stream; - for stdin, tcp:[host:]port or" << std::endl;
+    std::cout << "                           unix:path to accept one connection and stream what it sends" << std::endl;
+    std::cout << "  -b, --baud <rate>        Baudrate, any rate the adapter supports (default: 115200)" << std::endl;
+    std::cout << "  -c, --compact            Compact lines before sending (strip spaces, redundant words)" << std::endl;
+    std::cout << "  -p, --precision <n>      Decimals kept on coordinates in compact mode (default: " << DEFAULT_COMPACT_PRECISION << ")" << std::endl;
+    std::cout << "      --keep-comments      Send ';' and '( )' comments on to GRBL (e.g. for (MSG,...))" << std::endl;
+    std::cout << "      --uppercase          Uppercase lines outside comments" << std::endl;
+    std::cout << "      --strip-spaces       Remove spaces and tabs inside lines" << std::endl;
+    std::cout << "      --coalesce <mm>      Merge collinear G1 segments and fit arcs, keeping the path" << std::endl;
+    std::cout << "                           within this deviation" << std::endl;
+    std::cout << "      --no-arc-fit         With --coalesce, only merge straight runs" << std::endl;
+    std::cout << "  -q, --status-hz <rate>   Poll GRBL status ('?') at this rate while streaming" << std::endl;
+    std::cout << "  -r, --rx-buffer <n|auto> GRBL RX buffer size in bytes, or ask the controller (default: " << RX_BUFFER_SIZE << ")" << std::endl;
+    std::cout << "      --rx-verify          Check the RX window against status reports and correct drift" << std::endl;
+    std::cout << "      --planner-aware      Track planner blocks queued and report when the host or the link" << std::endl;
+    std::cout << "                           starved the planner (polls status at " << PLANNER_STATUS_HZ << " Hz without -q)" << std::endl;
+    std::cout << "      --stats-file <path>  Write run statistics as JSON (*.json) or CSV" << std::endl;
+    std::cout << "      --log-file <path>    Write the per-line log (sends, acks, responses) to path" << std::endl;
+    std::cout << "      --trace <path>       Record every byte sent and received, with timestamps, for" << std::endl;
+    std::cout << "                           grbl_bench --replay" << std::endl;
+    std::cout << "      --shm-stats          Publish live statistics in shared memory (/dev/shm/grbl_streamer.<tty>)" << std::endl;
+    std::cout << "      --watch <device>     Print the live statistics of the streamer running on device" << std::endl;
+    std::cout << "      --checkpoint <file>  Record progress of the job in file" << std::endl;
+    std::cout << "      --resume             Continue the job after its last acknowledged line" << std::endl;
+    std::cout << "                           (checkpoint defaults to <gcode>.checkpoint)" << std::endl;
+    std::cout << "      --start-line <n>     Start the job at source line n, restoring the modal state before it" << std::endl;
+    std::cout << "      --progress           Print progress and time left every " << PROGRESS_INTERVAL.count() << " s" << std::endl;
+    std::cout << "      --no-reset           Attach to an idle controller without waking it up" << std::endl;
+    std::cout << "      --handshake-timeout <ms>" << std::endl;
+    std::cout << "                           Longest wait for the controller at start (default: " << HANDSHAKE_TIMEOUT_MS << ")" << std::endl;
+    std::cout << "      --no-low-latency     Leave the driver's latency settings (and FTDI latency timer) alone" << std::endl;
+    std::cout << "      --serve <tcp:[host:]port|unix:path>" << std::endl;
+    std::cout << "                           Bridge mode: stream what each client sends and return" << std::endl;
+    std::cout << "                           GRBL's responses to it" << std::endl;
+    std::cout << "      --batch <list|dir>   Run every file of a list file or spool directory on one -S" << std::endl;
+    std::cout << "                           connection, each once GRBL is Idle after the last" << std::endl;
+    std::cout << "      --control <path>     Unix socket that passes real-time commands (!, ~, ?, 0x18," << std::endl;
+    std::cout << "                           overrides 0x90-0x9D, ...) straight to the controller" << std::endl;
+    std::cout << "      --on-error <policy>  halt (default), skip or skip:<code>,... to pass over lines GRBL" << std::endl;
+    std::cout << "                           rejects, pause to hold until '~' arrives on the control socket" << std::endl;
+    std::cout << "      --check              Dry run in GRBL's check mode ($C) at full speed, listing every" << std::endl;
+    std::cout << "                           line GRBL rejects (RX buffer detected without -r)" << std::endl;
+    std::cout << "      --validate           Check the G-code file and estimate its run time first;" << std::endl;
+    std::cout << "                           without -S only the check is run" << std::endl;
+    std::cout << "      --rapid-rate <mm/min> G0 rate for the estimate (default: " << DEFAULT_RAPID_RATE << ")" << std::endl;
     std::cout << "  -v, --verbose            Enable verbose output" << std::endl;
     std::cout << "  -h, --help               Display this help message" << std::endl;
     std::cout << std::endl;
     std::cout << "Example: " << progName << " -S /dev/ttyUSB0 -f example.gcode -b 115200 -v" << std::endl;
+    std::cout << "         " << progName << " -S /dev/ttyUSB0:a.gcode -S /dev/ttyUSB1:b.gcode" << std::endl;
+    std::cout << "Exit codes: 0 done, 1 setup or I/O error, 2 GRBL error, 3 alarm or reset," << std::endl;
+    std::cout << "            4 stopped by soft reset, 5 done with lines skipped after errors" << std::endl;
 }
 
+// Values for long options that have no short form
+enum LongOnlyOption {
+    OPT_RX_VERIFY = 256,
+    OPT_STATS_FILE,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_NO_RESET,
+    OPT_HANDSHAKE_TIMEOUT,
+    OPT_NO_LOW_LATENCY,
+    OPT_VALIDATE,
+    OPT_RAPID_RATE,
+    OPT_SERVE,
+    OPT_COALESCE,
+    OPT_NO_ARC_FIT,
+    OPT_PLANNER_AWARE,
+    OPT_PROGRESS,
+    OPT_START_LINE,
+    OPT_LOG_FILE,
+    OPT_CONTROL,
+    OPT_ON_ERROR,
+    OPT_CHECK,
+    OPT_KEEP_COMMENTS,
+    OPT_UPPERCASE,
+    OPT_STRIP_SPACES,
+    OPT_SHM_STATS,
+    OPT_WATCH,
+    OPT_BATCH,
+    OPT_TRACE,
+};
+
 int main(int argc, char* argv[]) {
-    const char* serial_device = nullptr;
+    std::vector<const char*> serial_devices;
     const char* gcode_file_path = nullptr;
-    int baud_int = 115200;  // Default baudrate as int
-    bool verbose = false;
+    Settings settings;
+    bool rx_buffer_set = false;
+    const char* watch_device = nullptr;
 
     // Define long options
     static struct option long_options[] = {
         {"serial", required_argument, nullptr, 'S'},
         {"file", required_argument, nullptr, 'f'},
         {"baud", required_argument, nullptr, 'b'},
+        {"compact", no_argument, nullptr, 'c'},
+        {"precision", required_argument, nullptr, 'p'},
+        {"status-hz", required_argument, nullptr, 'q'},
+        {"rx-buffer", required_argument, nullptr, 'r'},
+        {"rx-verify", no_argument, nullptr, OPT_RX_VERIFY},
+        {"stats-file", required_argument, nullptr, OPT_STATS_FILE},
+        {"log-file", required_argument, nullptr, OPT_LOG_FILE},
+        {"trace", required_argument, nullptr, OPT_TRACE},
+        {"shm-stats", no_argument, nullptr, OPT_SHM_STATS},
+        {"watch", required_argument, nullptr, OPT_WATCH},
+        {"control", required_argument, nullptr, OPT_CONTROL},
+        {"on-error", required_argument, nullptr, OPT_ON_ERROR},
+        {"check", no_argument, nullptr, OPT_CHECK},
+        {"checkpoint", required_argument, nullptr, OPT_CHECKPOINT},
+        {"resume", no_argument, nullptr, OPT_RESUME},
+        {"no-reset", no_argument, nullptr, OPT_NO_RESET},
+        {"no-low-latency", no_argument, nullptr, OPT_NO_LOW_LATENCY},
+        {"serve", required_argument, nullptr, OPT_SERVE},
+        {"batch", required_argument, nullptr, OPT_BATCH},
+        {"keep-comments", no_argument, nullptr, OPT_KEEP_COMMENTS},
+        {"uppercase", no_argument, nullptr, OPT_UPPERCASE},
+        {"strip-spaces", no_argument, nullptr, OPT_STRIP_SPACES},
+        {"coalesce", required_argument, nullptr, OPT_COALESCE},
+        {"no-arc-fit", no_argument, nullptr, OPT_NO_ARC_FIT},
+        {"planner-aware", no_argument, nullptr, OPT_PLANNER_AWARE},
+        {"progress", no_argument, nullptr, OPT_PROGRESS},
+        {"start-line", required_argument, nullptr, OPT_START_LINE},
+        {"validate", no_argument, nullptr, OPT_VALIDATE},
+        {"rapid-rate", required_argument, nullptr, OPT_RAPID_RATE},
+        {"handshake-timeout", required_argument, nullptr, OPT_HANDSHAKE_TIMEOUT},
         {"verbose", no_argument, nullptr, 'v'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "S:f:b:vh", long_options, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "S:f:b:cp:q:r:vh", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'S':
-                serial_device = optarg;
+                serial_devices.push_back(optarg);
                 break;
             case 'f':
                 gcode_file_path = optarg;
                 break;
             case 'b':
-                baud_int = std::stoi(optarg);  // Convert string to int for baudrate
+                settings.baud = std::stoi(optarg);  // Convert string to int for baudrate
+                break;
+            case 'c':
+                settings.compact = true;
+                break;
+            case 'p':
+                settings.compact_precision = std::stoi(optarg);
+                break;
+            case 'q':
+                settings.stream.status_hz = std::stod(optarg);
+                break;
+            case 'r':
+                rx_buffer_set = true;
+                if (strcmp(optarg, "auto") == 0) {
+                    settings.detect_rx_buffer = true;
+                } else {
+                    settings.stream.rx_buffer = std::stoi(optarg);
+                }
+                break;
+            case OPT_RX_VERIFY:
+                settings.stream.rx_verify = true;
+                break;
+            case OPT_STATS_FILE:
+                settings.stats_file_path = optarg;
+                break;
+            case OPT_LOG_FILE:
+                settings.log_file_path = optarg;
+                break;
+            case OPT_CONTROL:
+                settings.control_path = optarg;
+                break;
+            case OPT_ON_ERROR:
+                if (!parseErrorPolicy(optarg, settings.stream.on_error)) {
+                    std::cerr << "Error: --on-error takes halt, pause, skip or skip:<code>,..." << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_CHECKPOINT:
+                settings.checkpoint_path = optarg;
+                break;
+            case OPT_RESUME:
+                settings.resume = true;
+                break;
+            case OPT_NO_RESET:
+                settings.reset = false;
+                break;
+            case OPT_HANDSHAKE_TIMEOUT:
+                settings.handshake_timeout_ms = std::stoi(optarg);
+                break;
+            case OPT_NO_LOW_LATENCY:
+                settings.low_latency = false;
+                break;
+            case OPT_SERVE:
+                settings.serve = optarg;
+                break;
+            case OPT_COALESCE:
+                settings.coalesce_tolerance = std::stod(optarg);
+                break;
+            case OPT_NO_ARC_FIT:
+                settings.arc_fit = false;
+                break;
+            case OPT_PLANNER_AWARE:
+                settings.stream.planner_aware = true;
+                break;
+            case OPT_PROGRESS:
+                settings.stream.progress = true;
+                break;
+            case OPT_START_LINE:
+                settings.start_line = std::stoull(optarg);
+                break;
+            case OPT_CHECK:
+                settings.check = true;
+                break;
+            case OPT_SHM_STATS:
+                settings.shm_stats = true;
+                break;
+            case OPT_WATCH:
+                watch_device = optarg;
+                break;
+            case OPT_BATCH:
+                settings.batch = optarg;
+                break;
+            case OPT_TRACE:
+                settings.trace_path = optarg;
+                break;
+            case OPT_KEEP_COMMENTS:
+                settings.clean_flags |= CLEAN_KEEP_COMMENTS;
+                break;
+            case OPT_UPPERCASE:
+                settings.clean_flags |= CLEAN_UPPERCASE;
+                break;
+            case OPT_STRIP_SPACES:
+                settings.clean_flags |= CLEAN_STRIP_SPACES;
+                break;
+            case OPT_VALIDATE:
+                settings.validate = true;
+                break;
+            case OPT_RAPID_RATE:
+                settings.rapid_rate = std::stod(optarg);
                 break;
             case 'v':
-                verbose = true;
+                settings.verbose = true;
                 break;
             case 'h':
                 printHelp(argv[0]);
@@ -141,193 +5433,209 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (watch_device != nullptr) return watchStats(watch_device);
+
+    if (settings.validate && serial_devices.empty() && gcode_file_path != nullptr) {
+        return validateJob(gcode_file_path, settings) ? 0 : 1;
+    }
+
+    // Pair every device with its G-code file: either -S device -f file, or
+    // one or more -S device:file
+    std::vector<std::unique_ptr<Job>> jobs;
+    for (const char* device : serial_devices) {
+        auto job = std::make_unique<Job>();
+        const char* colon = strchr(device, ':');
+        if (settings.serve != nullptr) {
+            if (serial_devices.size() > 1 || gcode_file_path != nullptr || !isSocketInput(settings.serve)) {
+                std::cerr << "Error: --serve takes tcp:[host:]port or unix:path and one -S <device>." << std::endl;
+                return 1;
+            }
+            job->device = device;
+            job->gcode_path = settings.serve;
+        } else if (settings.batch != nullptr) {
+            if (serial_devices.size() > 1 || gcode_file_path != nullptr || colon != nullptr) {
+                std::cerr << "Error: --batch takes one -S <device> and no -f." << std::endl;
+                return 1;
+            }
+            job->device = device;
+        } else if (colon != nullptr && gcode_file_path == nullptr) {
+            job->device.assign(device, colon);
+            job->gcode_path = colon + 1;
+        } else if (colon == nullptr && gcode_file_path != nullptr && serial_devices.size() == 1) {
+            job->device = device;
+            job->gcode_path = gcode_file_path;
+        } else {
+            std::cerr << "Error: use either -S <device> -f <gcode> or -S <device>:<gcode> pairs." << std::endl;
+            return 1;
+        }
+        jobs.push_back(std::move(job));
+    }
+
     // Check required arguments
-    if (serial_device == nullptr || gcode_file_path == nullptr) {
+    if (jobs.empty()) {
         std::cerr << "Error: Serial device and G-code file are required." << std::endl;
         printHelp(argv[0]);
         return 1;
     }
-
-    if (verbose) {
-        std::cout << "Opening serial port: " << serial_device << std::endl;
-    }
-    // Open the serial port non-blocking
-    int fd = open(serial_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (fd == -1) {
-        std::cerr << "Error opening serial port: " << serial_device << std::endl;
+    if (settings.stream.rx_buffer < 1 || settings.stream.rx_buffer > MAX_RX_BUFFER_SIZE) {
+        std::cerr << "Error: RX buffer size must be between 1 and " << MAX_RX_BUFFER_SIZE << "." << std::endl;
         return 1;
     }
-    if (verbose) {
-        std::cout << "Serial port opened successfully." << std::endl;
-        std::cout << "Configuring serial port at baudrate: " << baud_int << std::endl;
+    if (settings.stream.rx_verify && settings.stream.status_hz <= 0) {
+        settings.stream.status_hz = 10;  // Verification needs status reports
     }
-
-    // Get speed_t from int
-    speed_t baudrate = get_baudrate(baud_int);
-
-    // Configure the serial port
-    struct termios options;
-    memset(&options, 0, sizeof(options));
-    tcgetattr(fd, &options);
-    cfsetispeed(&options, baudrate);
-    cfsetospeed(&options, baudrate);
-    options.c_cflag = (CLOCAL | CREAD | CS8);  // 8N1, no parity, 1 stop bit
-    options.c_iflag = IGNPAR;                  // Ignore parity errors
-    options.c_oflag = 0;
-    options.c_lflag = 0;                       // Non-canonical mode
-    options.c_cc[VTIME] = 0;                   // No timeout
-    options.c_cc[VMIN] = 1;                    // Read at least 1 char
-    tcflush(fd, TCIFLUSH);
-    if (tcsetattr(fd, TCSANOW, &options) != 0) {
-        std::cerr << "Error setting serial attributes." << std::endl;
-        close(fd);
+    if (settings.checkpoint_path != nullptr && jobs.size() > 1) {
+        std::cerr << "Error: --checkpoint names one file; several jobs use <gcode>.checkpoint." << std::endl;
         return 1;
     }
-    if (verbose) {
-        std::cout << "Serial port configured successfully." << std::endl;
-        std::cout << "Waking up GRBL..." << std::endl;
+    if (settings.batch != nullptr && (settings.serve != nullptr || settings.resume || settings.checkpoint_path != nullptr ||
+                                      settings.start_line > 0)) {
+        std::cerr << "Error: --batch cannot be combined with --serve, --resume, --checkpoint or --start-line." << std::endl;
+        return 1;
     }
-
-    // Wake up GRBL
-    write(fd, "\r\n\r\n", 4);
-    std::this_thread::sleep_for(std::chrono::seconds(2));
-    tcflush(fd, TCIFLUSH);  // Flush any startup text
-    if (verbose) {
-        std::cout << "GRBL woken up." << std::endl;
+    if (settings.start_line > 0 && (settings.resume || settings.serve != nullptr)) {
+        std::cerr << "Error: --start-line cannot be combined with --resume or --serve." << std::endl;
+        return 1;
     }
-
-    // Read and echo any initial response after wakeup (with timeout for initial)
-    {
-        struct timeval tv_initial;
-        tv_initial.tv_sec = 1;  // 1 second timeout for initial response
-        tv_initial.tv_usec = 0;
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        int retval = select(fd + 1, &rfds, nullptr, nullptr, &tv_initial);
-        if (retval > 0) {
-            std::string initial_response = readSerialLine(fd, verbose);  // Temporary use with indefinite, but since data ready
-            if (!initial_response.empty()) {
-                std::cout << "Initial GRBL response: " << initial_response;
-            }
+    if (settings.stream.on_error.action == ErrorPolicy::PAUSE && settings.control_path == nullptr) {
+        std::cerr << "Error: --on-error pause needs --control to continue from." << std::endl;
+        return 1;
+    }
+    if (settings.check) {
+        if (settings.serve != nullptr || settings.resume || settings.checkpoint_path != nullptr) {
+            std::cerr << "Error: --check cannot be combined with --serve, --resume or --checkpoint." << std::endl;
+            return 1;
         }
+        // Nothing moves, so stream with the whole RX buffer and collect every error
+        if (!rx_buffer_set) settings.detect_rx_buffer = true;
+        settings.stream.on_error = ErrorPolicy();
+        settings.stream.on_error.action = ErrorPolicy::SKIP;
     }
+    settings.stream.label = jobs.size() > 1;
 
-    if (verbose) {
-        std::cout << "Opening G-code file: " << gcode_file_path << std::endl;
-    }
-    // Open the G-code file
-    std::ifstream gcode_file(gcode_file_path);
-    if (!gcode_file.is_open()) {
-        std::cerr << "Error opening G-code file: " << gcode_file_path << std::endl;
-        close(fd);
+    // Real-time commands can be sent to the jobs through the control socket
+    ControlChannel control;
+    if (settings.control_path != nullptr && !control.listen(settings.control_path)) {
+        std::cerr << "Error listening on " << settings.control_path << ": " << strerror(errno) << std::endl;
         return 1;
     }
-    if (verbose) {
-        std::cout << "G-code file opened successfully." << std::endl;
-    }
-
-    int return_code = 0;
-    int available = RX_BUFFER_SIZE;
-    std::queue<size_t> pending_lengths;
-    std::string line;
 
-    while (true) {
-        // Send as many lines as possible
-        while (available > 0 && std::getline(gcode_file, line)) {
-            // Skip empty lines
-            if (line.empty()) continue;
+    // The per-line log of -v is written by a background thread
+    AsyncLogger logger;
+    if (settings.verbose || settings.log_file_path != nullptr) {
+        if (!logger.start(settings.log_file_path)) {
+            std::cerr << "Error opening log file: " << settings.log_file_path << std::endl;
+            return 1;
+        }
+        settings.stream.log = &logger;
+    }
 
-            // Strip comments (lines starting with ';')
-            size_t comment_pos = line.find(';');
-            if (comment_pos != std::string::npos) {
-                line = line.substr(0, comment_pos);
-            }
-            line.erase(line.find_last_not_of(" \t\r\n") + 1);  // Trim trailing whitespace
-            if (line.empty()) continue;
+    // Every byte to and from the ports is recorded by another background thread
+    TraceRecorder trace;
+    if (settings.trace_path != nullptr) {
+        if (!trace.start(settings.trace_path, settings.baud)) {
+            std::cerr << "Error opening trace file: " << settings.trace_path << std::endl;
+            return 1;
+        }
+        serial_trace = &trace;
+    }
 
-            // Calculate length including \n
-            size_t len = line.length() + 1;
-            if (len > available) {
-                // Cannot send yet, put back the line by seeking back
-                gcode_file.seekg(-static_cast<std::streamoff>(line.length() + 1), std::ios::cur);
-                break;
-            }
+    // SIGUSR1 prints the statistics so far; no SA_RESTART so epoll_wait() wakes up
+    struct sigaction stats_action;
+    memset(&stats_action, 0, sizeof(stats_action));
+    stats_action.sa_handler = handleStatsSignal;
+    sigaction(SIGUSR1, &stats_action, nullptr);
 
-            // Send the line
-            std::string send_line = line + "\n";
-            if (verbose) {
-                std::cout << "Sending: " << line << " (len: " << len << ", available: " << available << ")" << std::endl;
-            }
-            if (write(fd, send_line.c_str(), send_line.size()) != static_cast<ssize_t>(send_line.size())) {
-                std::cerr << "Error writing to serial port." << std::endl;
-                return_code = 1;
-                break;
+    for (auto& job : jobs) {
+        if (settings.serve == nullptr && settings.batch == nullptr && !loadJob(*job, settings)) return 1;
+    }
+    for (auto& job : jobs) {
+        job->fd = openSerialPort(job->device.c_str(), settings.baud, settings.low_latency, settings.verbose);
+        if (job->fd == -1) return 1;
+        if (settings.shm_stats) {
+            job->shared_stats = std::make_unique<SharedStatsSegment>();
+            if (!job->shared_stats->open(job->device)) {
+                std::cerr << "Error creating shared memory " << SharedStatsSegment::nameFor(job->device) << ": "
+                          << strerror(errno) << std::endl;
+                return 1;
             }
-
-            available -= len;
-            pending_lengths.push(len);
-        }
-
-        // If no more lines to send and no pending acknowledgments, done
-        if (pending_lengths.empty()) {
-            break;
         }
+    }
 
-        // Wait for response indefinitely
-        if (verbose) {
-            std::cout << "Waiting for response... (pending: " << pending_lengths.size() << ", available: " << available << ")" << std::endl;
+    // Wake up every controller at once so their start-up overlaps, then
+    // stream to each as soon as it is ready
+    if (settings.verbose) {
+        std::cout << (settings.reset ? "Waking up GRBL..." : "Attaching to GRBL...") << std::endl;
+    }
+    for (auto& job : jobs) {
+        if (settings.reset) serialWrite(job->fd, "\r\n\r\n", 4);
+        job->reader = std::make_unique<SerialLineReader>(job->fd);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.handshake_timeout_ms);
+    for (auto& job : jobs) {
+        std::string reply;
+        if (waitForController(*job->reader, job->fd, settings.reset, deadline, reply)) {
+            std::cout << "Initial GRBL response: " << reply << std::endl;
+        } else if (settings.reset) {
+            std::cerr << "No response from " << job->device << ", streaming anyway." << std::endl;
+            tcflush(job->fd, TCIFLUSH);  // Flush any startup text
+        } else {
+            std::cerr << "Error: " << job->device << " did not answer a status request." << std::endl;
+            return 1;
         }
-        std::string response = readSerialLine(fd, verbose);
-	if(verbose){
-            std::cout << response;
-	}
+    }
+    if (settings.verbose) {
+        std::cout << "GRBL ready." << std::endl;
+    }
+    if (settings.serve != nullptr) {
+        return serveClients(*jobs.front(), settings, control.listenerFd() != -1 ? &control : nullptr);
+    }
+    if (settings.batch != nullptr) {
+        return runBatch(*jobs.front(), settings, control.listenerFd() != -1 ? &control : nullptr);
+    }
 
-        // Trim whitespace
-        size_t start = response.find_first_not_of(" \t\r\n");
-        if (start != std::string::npos) {
-            response = response.substr(start);
-        }
-        size_t end = response.find_last_not_of(" \t\r\n");
-        if (end != std::string::npos) {
-            response = response.substr(0, end + 1);
-        }
-
-        // Convert to lowercase for case-insensitive comparison
-        std::string lower_response = response;
-        std::transform(lower_response.begin(), lower_response.end(), lower_response.begin(),
-                       [](unsigned char c){ return std::tolower(c); });
-
-        if (lower_response.find("ok") != std::string::npos) {
-            if (!pending_lengths.empty()) {
-                size_t len = pending_lengths.front();
-                pending_lengths.pop();
-                available += len;
-                if (verbose) {
-                    std::cout << "Received ok, freed " << len << " bytes (available now: " << available << ")" << std::endl;
+    for (size_t i = 0; settings.check && i < jobs.size(); ++i) {
+        if (!setCheckMode(*jobs[i]->reader, jobs[i]->fd, true)) {
+            std::cerr << "Error: " << jobs[i]->device << " did not enter check mode; it must be idle." << std::endl;
+            // Never leave the machines already switched over in check mode
+            for (size_t j = 0; j < i; ++j) {
+                if (!setCheckMode(*jobs[j]->reader, jobs[j]->fd, false)) {
+                    std::cerr << "Error: could not leave check mode on " << jobs[j]->device
+                              << "; reset the controller before running a job." << std::endl;
                 }
             }
-        } else {
-            std::cerr << "GRBL error detected: " << response << " Halting execution." << std::endl;
-            // return_code = 1;
-            break;
+            return 1;
         }
-
-        if (return_code != 0) break;
     }
 
-    if (verbose) {
-        if (return_code == 0) {
-            std::cout << "Streaming completed successfully." << std::endl;
-        } else {
-            std::cout << "Streaming halted due to error." << std::endl;
+    EventLoop loop;
+    for (auto& job : jobs) {
+        startJob(*job, settings);
+        if (!loop.add(*job->streamer)) {
+            perror("epoll_ctl");
+            return 1;
         }
     }
+    if (control.listenerFd() != -1 && !loop.addControl(control)) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    loop.run();
+    logger.stop();  // The log ends before the summaries
+    if (uint64_t dropped = trace.stop()) {
+        std::cerr << "Warning: " << dropped << " chunks of serial trace were dropped." << std::endl;
+    }
+
+    int return_code = 0;
+    for (auto& job : jobs) {
+        finishJob(*job, settings, jobs.size() > 1);
+        int job_code = job->streamer->exitCode();
+        if (settings.check && job_code == EXIT_ERRORS_SKIPPED) job_code = EXIT_GRBL_ERROR;  // A check fails on errors
+        if (return_code == 0) return_code = job_code;
+    }
 
     // Cleanup
-    gcode_file.close();
-    close(fd);
+    jobs.clear();
 
     return return_code;
 }
-